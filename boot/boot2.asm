@@ -33,6 +33,7 @@ BootInfo:
 BootInfo_StackTop		dd 0	; Address of top of stack
 BootInfo_KernelSize		dd 0	; Size of the kernel in bytes
 BootInfo_MemoryMap		dd 0	; Address of memory map
+BootInfo_MemoryMapCount	dd 0	; Number of entries in the memory map
 BootInfo_BootDevice		db 0	; Boot device id
 
 ;	Start of the second stage of the boot loader
@@ -67,6 +68,16 @@ Second_Stage:
 	mov		di, 1000h
 	mov		dword [BootInfo_MemoryMap], 1000h 
 	call	BIOSGetMemoryMap
+	jnc		GotMemoryMap
+	call	BIOSGetMemorySize		; INT 15h E820h is not supported, so use the older functions
+	jnc		GotMemoryMap
+	mov		si, noMemoryMapMsg		; Without a memory map, the kernel has no memory to use
+	call	Console_WriteLine_16
+	jmp		Cannot_Continue
+
+GotMemoryMap:
+	movzx	ebp, bp
+	mov		dword [BootInfo_MemoryMapCount], ebp
 	
 ;	First, load the root directory table
 	call	LoadRoot
@@ -20,7 +20,11 @@ endstruc
 ;			  Carry flag is set if an error occured
 
 BIOSGetMemoryMap:
-	pushad
+	push	eax										; Save everything except bp, which returns the count
+	push	ebx
+	push	ecx
+	push	edx
+	push	di
 	xor		ebx, ebx
 	xor		bp, bp									; Clear number of entries
 	mov		edx, 'PAMS'								; Set EDX to 'SMAP'
@@ -60,6 +64,102 @@ GetMemoryMap_Error:
 	stc
 
 GetMemoryMap_Done:
-	popad
+	pop		di										; pop does not change the carry flag
+	pop		edx
+	pop		ecx
+	pop		ebx
+	pop		eax
+	ret
+
+;  Build a memory map from the memory sizes returned by older BIOS functions.
+;  This is used when the BIOS does not support INT 15h E820h.  Conventional memory
+;  comes from INT 12h and extended memory from INT 15h E801h, or from INT 15h 88h
+;  if that is not supported either.
+;
+;  On entry:  es:di = Destination buffer for entries
+;  On exit:	  bp    = Entry count
+;			  Carry flag is set if the size of extended memory could not be found
+
+BIOSGetMemorySize:
+	push	eax
+	push	ebx
+	push	ecx
+	push	edx
+	push	di
+	xor		bp, bp									; Clear number of entries
+	int		12h										; Get conventional memory size in KB
+	movzx	ecx, ax
+	shl		ecx, 10
+	xor		eax, eax								; Conventional memory starts at 0
+	call	AddMemoryMapEntry
+
+	xor		cx, cx									; Some BIOSes only return the sizes in ax and bx
+	xor		dx, dx
+	mov		ax, 0e801h
+	int		15h
+	jc		GetMemorySize_Try88
+	cmp		ah, 86h									; Function not supported
+	je		GetMemorySize_Try88
+	cmp		ah, 80h									; Invalid command
+	je		GetMemorySize_Try88
+	jcxz	GetMemorySize_UseAX						; If cx is 0, the sizes are in ax and bx
+	mov		ax, cx
+	mov		bx, dx
+
+GetMemorySize_UseAX:
+	movzx	ecx, ax									; ax = KB between 1MB and 16MB
+	shl		ecx, 10
+	mov		eax, 100000h
+	call	AddMemoryMapEntry
+	movzx	ecx, bx									; bx = Number of 64KB blocks above 16MB
+	shl		ecx, 16
+	mov		eax, 1000000h
+	call	AddMemoryMapEntry
+	clc
+	jmp		GetMemorySize_Done
+
+GetMemorySize_Try88:
+	mov		ah, 88h
+	int		15h										; Get KB of memory above 1MB
+	jc		GetMemorySize_Error
+	test	ax, ax
+	jz		GetMemorySize_Error
+	movzx	ecx, ax
+	shl		ecx, 10
+	mov		eax, 100000h
+	call	AddMemoryMapEntry
+	clc
+	jmp		GetMemorySize_Done
+
+GetMemorySize_Error:
+	stc
+
+GetMemorySize_Done:
+	pop		di
+	pop		edx
+	pop		ecx
+	pop		ebx
+	pop		eax
+	ret
+
+;  Add an available memory region to the memory map.  Nothing is added if the length is 0.
+;
+;  On entry:  es:di = Next entry in the memory map
+;			  eax   = Base address of the region
+;			  ecx   = Length of the region in bytes
+;			  bp    = Entry count
+;  On exit:	  es:di and bp are updated if an entry was added
+
+AddMemoryMapEntry:
+	jecxz	AddMemoryMapEntry_Done
+	mov		[es:di + MemoryMapEntry.baseAddress], eax
+	mov		dword [es:di + MemoryMapEntry.baseAddress + 4], 0
+	mov		[es:di + MemoryMapEntry.length], ecx
+	mov		dword [es:di + MemoryMapEntry.length + 4], 0
+	mov		dword [es:di + MemoryMapEntry.type], 1	; Available memory
+	inc		bp
+	add		di, 20
+
+AddMemoryMapEntry_Done:
 	ret
 
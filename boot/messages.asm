@@ -10,6 +10,7 @@ no_a20_msg			db 'Unable to enable A20 line.', 0
 loadingMsg 	  		db 'Searching for KERNEL.SYS...', 0
 msgFailure 	  		db 'Unable to find KERNEL.SYS. ', 0
 msgWaitForKey		db 'Press Enter key to continue', 0
+noMemoryMapMsg		db 'Unable to get memory map from BIOS', 0
 
 a20_message_list	dw no_a20_msg
 					dw a20_msg_one
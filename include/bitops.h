@@ -0,0 +1,26 @@
+#ifndef _BITOPS_H
+#define _BITOPS_H
+
+// Bit scanning
+
+#include <stdint.h>
+
+// Return the index of the lowest set bit in value. value must not be 0.
+
+static inline uint32_t BitScanForward(uint32_t value)
+{
+	uint32_t index;
+	asm("bsfl %1, %0" : "=r"(index) : "rm"(value));
+	return index;
+}
+
+// Return the index of the highest set bit in value. value must not be 0.
+
+static inline uint32_t BitScanReverse(uint32_t value)
+{
+	uint32_t index;
+	asm("bsrl %1, %0" : "=r"(index) : "rm"(value));
+	return index;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _BLOCKCACHE_H
+#define _BLOCKCACHE_H
+
+// Block cache
+//
+// Keeps recently read disk blocks in memory. A block is read with bread,
+// which returns a buffer that stays valid until it is given back with brelse.
+
+#include <stdint.h>
+
+#define BLOCK_SIZE	512
+
+typedef struct _BlockBuffer
+{
+	uint8_t					Device;			// Drive the block was read from
+	uint32_t				Block;			// Block number (LBA) on the device
+	uint32_t				RefCount;		// Number of bread calls not yet matched by brelse
+	bool					Valid;			// Set when Data holds the block
+	uint8_t *				Data;			// BLOCK_SIZE bytes of block contents
+	struct _BlockBuffer *	HashNext;
+	struct _BlockBuffer *	Newer;			// Position in the least recently used list
+	struct _BlockBuffer *	Older;
+} BlockBuffer;
+
+// Statistics reported by BlockCache_GetStatistics
+
+typedef struct _BlockCacheStatistics
+{
+	uint32_t	Capacity;			// Number of buffers in the cache
+	uint32_t	CachedBlocks;		// Number of buffers holding a block
+	uint32_t	BuffersInUse;		// Number of buffers held by callers
+	uint32_t	Hits;				// Reads satisfied from the cache
+	uint32_t	Misses;				// Reads that had to go to the disk
+	uint32_t	Evictions;			// Blocks dropped to make room for others
+	uint32_t	ReadAhead;			// Blocks cached because they were on a track that was read
+} BlockCacheStatistics;
+
+// Create a cache of 'capacity' buffers. The kernel heap must be initialised.
+
+void BlockCache_Initialise(uint32_t capacity);
+
+// Get a buffer holding a block from a device, reading it if it is not
+// already cached. Returns 0 if it cannot be read or every buffer is in use.
+
+BlockBuffer* bread(uint8_t device, uint32_t block);
+
+// Give back a buffer returned by bread
+
+void brelse(BlockBuffer* buffer);
+
+// Drop every block cached for a device that is not in use, for example when
+// the disk has been changed
+
+void BlockCache_InvalidateDevice(uint8_t device);
+
+// Drop 'count' blocks of a device from the cache because they are about to be
+// written, including blocks that are being held or read. Returns a value to
+// pass to BlockCache_Update once the write has succeeded.
+
+uint32_t BlockCache_InvalidateRange(uint8_t device, uint32_t block, uint32_t count);
+
+// Put 'count' blocks that have been written from 'data' into the cache.
+// 'generation' is the value returned by BlockCache_InvalidateRange before the
+// write. Nothing is cached if other blocks have been invalidated since.
+
+void BlockCache_Update(uint8_t device, uint32_t block, uint32_t count, const uint8_t* data, uint32_t generation);
+
+void BlockCache_GetStatistics(BlockCacheStatistics * statistics);
+
+#endif
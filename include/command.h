@@ -22,6 +22,10 @@ void cd(char* arguments);
 void showFileInfo(char* arguments);
 void read(char* arguments);
 void dbg(char* arguments);
+void memtrace(char* arguments);
+void heapstat(char* arguments);
+void vmstat(char* arguments);
+void cachestat(char* arguments);
 
 
 void incorrectFunction(char* arguments);
@@ -2,13 +2,14 @@
 #define _F12Funcs_H
 
 #include <filesystem.h>
+#include <blockcache.h>
 
 void FsFat12_Initialise();
 
 //Functions related to reading data from disk
 uint16_t FsFat12_GetFATEntry(int sectorNum);
-uint8_t* FsFat12_ReadCluster(int cluster);
-uint8_t* FsFat12_GetNextClusterOfCurrentFile(int firstSector, int sectorOffset);
+BlockBuffer* FsFat12_ReadCluster(int cluster);
+BlockBuffer* FsFat12_GetNextClusterOfCurrentFile(int firstSector, int sectorOffset);
 
 //functions used when interpreting filepaths
 char* ExtractFileName(const char* nameAndExt);
@@ -25,7 +26,7 @@ void SetCurrentDirPath(const char* newPath);
 
 
 //Functions for opening, reading, and closing files.
-FILE FsFat12_Open(const char* filename);
+PFILE FsFat12_Open(const char* filename);
 unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length);
 void FsFat12_Close(PFILE file);
 
@@ -6,7 +6,37 @@
 
 #include <stdint.h>
 
-// Set address for floppy drive to use for DMA transfers
+// Number of sectors read by FloppyDriveReadTrack: 18 sectors on each head
+#define FLOPPY_TRACK_READ_SECTORS	36
+
+// Requests are queued and carried out in turn, driven by the floppy disk
+// interrupt, so the processor is free while the drive seeks and the disk
+// turns.
+
+typedef enum _FloppyRequestStatus
+{
+	FLOPPY_REQUEST_QUEUED,
+	FLOPPY_REQUEST_ACTIVE,
+	FLOPPY_REQUEST_DONE,
+	FLOPPY_REQUEST_FAILED
+} FloppyRequestStatus;
+
+typedef struct _FloppyRequest
+{
+	uint8_t							Drive;
+	uint32_t						Sector;			// LBA of the first sector
+	uint32_t						Count;			// Number of sectors, all on the same track
+	uint8_t *						Buffer;			// Count * 512 bytes to read into or write from
+	bool							Write;
+	void							(*Completion)(struct _FloppyRequest * request);
+	void *							Context;		// For the use of whoever made the request
+	uint32_t						CacheGeneration;	// Set by FloppyDriveSubmitRequest for writes
+	volatile FloppyRequestStatus	Status;
+	struct _FloppyRequest *			Next;
+} FloppyRequest;
+
+// Set address for floppy drive to use for DMA transfers. It must be able to
+// hold FLOPPY_TRACK_READ_SECTORS sectors.
 void FloppyDriveSetDMA(int addr);
 
 // Convert LBA to CHS
@@ -21,7 +51,33 @@ void FloppyDriveSetWorkingDrive(uint8_t drive);
 //! get current working drive
 uint8_t FloppyDriveGetWorkingDrive(); 
 
-// Read a sector
+// Set the number of clock ticks the motor is left running after a request,
+// so that requests close together do not wait for it to spin up each time. 0
+// turns it off as soon as the queue is empty.
+void FloppyDriveSetMotorIdleTime(uint32_t ticks); 
+
+// Queue a request and return straight away. The request must stay in memory
+// until its Status is FLOPPY_REQUEST_DONE or FLOPPY_REQUEST_FAILED, at which
+// point Completion, if set, is called from the interrupt handler. Returns
+// false if the request is not valid. A write drops its blocks from the block
+// cache when it is submitted.
+bool FloppyDriveSubmitRequest(FloppyRequest * request); 
+
+// Halt until a request has finished. Returns true if it succeeded, in which
+// case the blocks of a write are put in the block cache. Must not be called
+// from an interrupt handler or completion function.
+bool FloppyDriveWaitForRequest(FloppyRequest * request); 
+
+// Read sectors from the working drive into 'buffer' and wait for them
+bool FloppyDriveReadSectors(int sectorLBA, uint32_t count, uint8_t* buffer); 
+
+// Read a sector from the working drive and return the address of a buffer
+// holding it, which the next call overwrites, or 0 if it could not be read.
+// Everything else should read through the block cache.
 uint8_t* FloppyDriveReadSector(int sectorLBA); 
 
+// Read every sector of a track, head 0 then head 1, in one command, into
+// 'buffer'. The first sector is LBA track * FLOPPY_TRACK_READ_SECTORS.
+bool FloppyDriveReadTrack(int track, uint8_t* buffer); 
+
 #endif
@@ -39,6 +39,12 @@ void  HAL_EnableInterrupts();
 // HAL_DisableInterrupts all hardware interrupts
 void  HAL_DisableInterrupts();
 
+// Disable interrupts, returning whether they were enabled, so that code that
+// may already be running with them disabled can put them back as they were
+bool HAL_SaveAndDisableInterrupts();
+
+void HAL_RestoreInterrupts(bool enabled);
+
 // Set new interrupt vector
 void  HAL_SetInterruptVector(int intno, void (*vect)());
 
@@ -48,12 +54,29 @@ void (*HAL_GetInterruptVector(int intno))();
 // Return CPU vender
 const char *  HAL_GetCPUVendor();
 
+// Feature flags returned by HAL_GetCPUFeatures
+#define HAL_CPU_FEATURE_PSE		(1 << 3)	// 4MB pages
+#define HAL_CPU_FEATURE_PGE		(1 << 13)	// Global pages
+#define HAL_CPU_FEATURE_SSE		(1 << 25)
+#define HAL_CPU_FEATURE_SSE2	(1 << 26)
+
+// Return the CPU feature flags
+uint32_t HAL_GetCPUFeatures();
+
 // Return current tick count 
 uint32_t HAL_GetTickCount();
 
 // Wait for a specified number of tick counts
 void HAL_Sleep(uint32_t tickCount); 
 
+// Call a function from the timer interrupt, with interrupts disabled, once a
+// number of ticks have passed. Returns the timer, or -1 if none are free.
+int HAL_StartTimer(uint32_t tickCount, void (*callback)());
+
+// Stop a timer started by HAL_StartTimer before it fires. The timer may be
+// given to another caller once it has fired, so only stop timers that have not.
+void HAL_StopTimer(int timer);
+
 // Routines to enable/disable paging and load/get the page directory register
 
 void HAL_EnablePaging(); 
@@ -62,8 +85,32 @@ void HAL_DisablePaging();
 
 bool HAL_IsPaging(); 
 
+// Allow page directory entries to map 4MB pages (check HAL_CPU_FEATURE_PSE first)
+
+void HAL_EnableLargePages();
+
+// Stop TLB entries for global pages being flushed when CR3 is loaded (check HAL_CPU_FEATURE_PGE first)
+
+void HAL_EnableGlobalPages();
+
+// Make supervisor mode writes fault on read-only pages, as user mode ones do
+
+void HAL_EnableWriteProtection();
+
+// Flush every entry from the TLB, including those for global pages
+
+void HAL_FlushTLB();
+
 void HAL_LoadPageDirectoryBaseRegister(uint32_t addr); 
 
 uint32_t HAL_GetPageDirectoryBaseRegister(); 
 
+// Get the address that caused the last page fault (CR2)
+
+uint32_t HAL_GetPageFaultAddress();
+
+// Get the number of processor cycles since it was reset
+
+uint64_t HAL_ReadTimeStampCounter();
+
 #endif
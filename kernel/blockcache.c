@@ -0,0 +1,397 @@
+// Block cache
+//
+// Disk blocks are cached in a fixed number of buffers, found by hashing the
+// device and block number. Every buffer is on a list ordered by when it was
+// last used. When a block is not in the cache, the least recently used
+// buffer that nobody is holding is given to it.
+//
+// Blocks are read from the floppy drive, with the device being the drive
+// number. Reads wait for the drive's request queue to finish them.
+//
+// Reading a whole track takes little longer than reading one sector from it,
+// so a miss reads the track the block is on and the rest of the track is put
+// in the cache as well. Reading on through a file then goes to the disk once
+// a track rather than once a sector.
+//
+// A write drops its blocks from the cache when it is submitted and puts them
+// back once it has succeeded. Reads that were already under way when a write
+// was submitted may have got the old data, so what they read is not cached.
+
+#include <string.h>
+#include <blockcache.h>
+#include <floppydisk.h>
+#include "kernelheap.h"
+
+// Number of hash chains. Must be a power of 2.
+
+#define BLOCK_CACHE_HASH_SIZE	64
+
+static	BlockBuffer *	_buffers = 0;
+static	uint32_t		_capacity = 0;
+
+static	BlockBuffer *	_hashTable[BLOCK_CACHE_HASH_SIZE];
+
+// Ends of the least recently used list. Buffers that do not hold a block
+// are kept at the oldest end so that they are used first.
+
+static	BlockBuffer *	_newest = 0;
+static	BlockBuffer *	_oldest = 0;
+
+static	uint32_t		_hits = 0;
+static	uint32_t		_misses = 0;
+static	uint32_t		_evictions = 0;
+static	uint32_t		_readAhead = 0;
+
+// Incremented whenever blocks are invalidated. A read only caches what it
+// read if this has not changed while it was waiting for the disk.
+static	uint32_t		_generation = 0;
+
+// Whole tracks are read into here before being copied into buffers
+static	uint8_t *		_trackBuffer = 0;
+
+uint32_t BlockHash(uint8_t device, uint32_t block)
+{
+	return (block * 31 + device) & (BLOCK_CACHE_HASH_SIZE - 1);
+}
+
+void BlockHashInsert(BlockBuffer * buffer)
+{
+	BlockBuffer ** chain = &_hashTable[BlockHash(buffer->Device, buffer->Block)];
+	buffer->HashNext = *chain;
+	*chain = buffer;
+}
+
+void BlockHashRemove(BlockBuffer * buffer)
+{
+	BlockBuffer ** link = &_hashTable[BlockHash(buffer->Device, buffer->Block)];
+	while (*link && *link != buffer)
+	{
+		link = &(*link)->HashNext;
+	}
+	if (*link)
+	{
+		*link = buffer->HashNext;
+	}
+	buffer->HashNext = 0;
+}
+
+void BlockListRemove(BlockBuffer * buffer)
+{
+	if (buffer->Newer)
+	{
+		buffer->Newer->Older = buffer->Older;
+	}
+	else
+	{
+		_newest = buffer->Older;
+	}
+	if (buffer->Older)
+	{
+		buffer->Older->Newer = buffer->Newer;
+	}
+	else
+	{
+		_oldest = buffer->Newer;
+	}
+}
+
+void BlockListAddNewest(BlockBuffer * buffer)
+{
+	buffer->Newer = 0;
+	buffer->Older = _newest;
+	if (_newest)
+	{
+		_newest->Newer = buffer;
+	}
+	else
+	{
+		_oldest = buffer;
+	}
+	_newest = buffer;
+}
+
+void BlockListAddOldest(BlockBuffer * buffer)
+{
+	buffer->Older = 0;
+	buffer->Newer = _oldest;
+	if (_oldest)
+	{
+		_oldest->Older = buffer;
+	}
+	else
+	{
+		_newest = buffer;
+	}
+	_oldest = buffer;
+}
+
+BlockBuffer * BlockLookup(uint8_t device, uint32_t block)
+{
+	BlockBuffer * buffer = _hashTable[BlockHash(device, block)];
+	while (buffer && (buffer->Device != device || buffer->Block != block))
+	{
+		buffer = buffer->HashNext;
+	}
+	return buffer;
+}
+
+// Take the least recently used buffer that is not being held off the list,
+// dropping the block it holds. Returns 0 if every buffer is held.
+
+BlockBuffer * BlockTakeUnused()
+{
+	BlockBuffer * buffer = _oldest;
+	while (buffer && buffer->RefCount > 0)
+	{
+		buffer = buffer->Newer;
+	}
+	if (!buffer)
+	{
+		return 0;
+	}
+	if (buffer->Valid)
+	{
+		BlockHashRemove(buffer);
+		buffer->Valid = false;
+		_evictions++;
+	}
+	BlockListRemove(buffer);
+	return buffer;
+}
+
+// Put a block that is not in the cache into a buffer that nobody is
+// holding. Returns false if every buffer is held.
+
+bool BlockInsert(uint8_t device, uint32_t block, const uint8_t * data)
+{
+	BlockBuffer * buffer = BlockTakeUnused();
+	if (!buffer)
+	{
+		return false;
+	}
+	memcpy(buffer->Data, data, BLOCK_SIZE);
+	buffer->Device = device;
+	buffer->Block = block;
+	buffer->Valid = true;
+	buffer->RefCount = 0;
+	BlockHashInsert(buffer);
+	BlockListAddNewest(buffer);
+	return true;
+}
+
+// Put a block that was read along with another one into the cache, unless
+// it is already there
+
+void BlockFill(uint8_t device, uint32_t block, uint8_t * data)
+{
+	if (!BlockLookup(device, block) && BlockInsert(device, block, data))
+	{
+		_readAhead++;
+	}
+}
+
+// Drop a block from the cache. If it is being held, the holder keeps its
+// data, but the next bread reads it again.
+
+void BlockInvalidate(BlockBuffer * buffer)
+{
+	BlockHashRemove(buffer);
+	buffer->Valid = false;
+	if (buffer->RefCount == 0)
+	{
+		BlockListRemove(buffer);
+		BlockListAddOldest(buffer);
+	}
+}
+
+// Read a block from a device into 'data', filling the cache with the rest of
+// its track. If the track cannot be read in one go, just the block is read.
+
+bool BlockReadFromDevice(uint8_t device, uint32_t block, uint8_t * data)
+{
+	uint8_t workingDrive = FloppyDriveGetWorkingDrive();
+	FloppyDriveSetWorkingDrive(device);
+	uint32_t track = block / FLOPPY_TRACK_READ_SECTORS;
+	uint32_t generation = _generation;
+	uint8_t* trackData = 0;
+	uint8_t* sector = 0;
+	if (_trackBuffer && FloppyDriveReadTrack(track, _trackBuffer))
+	{
+		trackData = _trackBuffer;
+	}
+	else
+	{
+		sector = FloppyDriveReadSector(block);
+	}
+	FloppyDriveSetWorkingDrive(workingDrive);
+	if (trackData)
+	{
+		uint32_t firstBlock = track * FLOPPY_TRACK_READ_SECTORS;
+		for (uint32_t i = 0; i < FLOPPY_TRACK_READ_SECTORS; i++)
+		{
+			if (firstBlock + i == block)
+			{
+				memcpy(data, trackData + i * BLOCK_SIZE, BLOCK_SIZE);
+			}
+			else if (_generation == generation)
+			{
+				BlockFill(device, firstBlock + i, trackData + i * BLOCK_SIZE);
+			}
+		}
+		return true;
+	}
+	if (!sector)
+	{
+		return false;
+	}
+	memcpy(data, sector, BLOCK_SIZE);
+	return true;
+}
+
+// Public functions
+
+void BlockCache_Initialise(uint32_t capacity)
+{
+	memset(_hashTable, 0, sizeof(_hashTable));
+	_newest = 0;
+	_oldest = 0;
+	_hits = 0;
+	_misses = 0;
+	_evictions = 0;
+	_readAhead = 0;
+	_capacity = 0;
+	_trackBuffer = (uint8_t*)kmalloc(FLOPPY_TRACK_READ_SECTORS * BLOCK_SIZE);
+	_buffers = (BlockBuffer*)kmalloc(capacity * sizeof(BlockBuffer));
+	uint8_t* data = (uint8_t*)kmalloc(capacity * BLOCK_SIZE);
+	if (!_buffers || !data)
+	{
+		return;
+	}
+	_capacity = capacity;
+	for (uint32_t i = 0; i < capacity; i++)
+	{
+		BlockBuffer * buffer = &_buffers[i];
+		buffer->Device = 0;
+		buffer->Block = 0;
+		buffer->RefCount = 0;
+		buffer->Valid = false;
+		buffer->Data = data + i * BLOCK_SIZE;
+		buffer->HashNext = 0;
+		BlockListAddNewest(buffer);
+	}
+}
+
+BlockBuffer* bread(uint8_t device, uint32_t block)
+{
+	BlockBuffer * buffer = BlockLookup(device, block);
+	if (buffer)
+	{
+		_hits++;
+		buffer->RefCount++;
+		BlockListRemove(buffer);
+		BlockListAddNewest(buffer);
+		return buffer;
+	}
+	_misses++;
+
+	buffer = BlockTakeUnused();
+	if (!buffer)
+	{
+		return 0;
+	}
+	uint32_t generation = _generation;
+	if (!BlockReadFromDevice(device, block, buffer->Data))
+	{
+		BlockListAddOldest(buffer);
+		return 0;
+	}
+	buffer->Device = device;
+	buffer->Block = block;
+	buffer->RefCount = 1;
+	if (_generation != generation)
+	{
+		// A write may have been submitted while the block was being read, so
+		// the caller gets what was read but it is not cached
+		buffer->Valid = false;
+		BlockListAddOldest(buffer);
+		return buffer;
+	}
+	buffer->Valid = true;
+	BlockHashInsert(buffer);
+	BlockListAddNewest(buffer);
+	return buffer;
+}
+
+void brelse(BlockBuffer* buffer)
+{
+	if (buffer && buffer->RefCount > 0)
+	{
+		buffer->RefCount--;
+	}
+}
+
+void BlockCache_InvalidateDevice(uint8_t device)
+{
+	for (uint32_t i = 0; i < _capacity; i++)
+	{
+		BlockBuffer * buffer = &_buffers[i];
+		if (buffer->Valid && buffer->Device == device && buffer->RefCount == 0)
+		{
+			BlockInvalidate(buffer);
+		}
+	}
+	_generation++;
+}
+
+uint32_t BlockCache_InvalidateRange(uint8_t device, uint32_t block, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		BlockBuffer * buffer = BlockLookup(device, block + i);
+		if (buffer)
+		{
+			BlockInvalidate(buffer);
+		}
+	}
+	return ++_generation;
+}
+
+void BlockCache_Update(uint8_t device, uint32_t block, uint32_t count, const uint8_t* data, uint32_t generation)
+{
+	if (_generation != generation)
+	{
+		// Something else has been written since, so the data may be out of date
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		// A block that is already cached was read after the write was queued,
+		// so it holds this data
+		if (!BlockLookup(device, block + i))
+		{
+			BlockInsert(device, block + i, data + i * BLOCK_SIZE);
+		}
+	}
+}
+
+void BlockCache_GetStatistics(BlockCacheStatistics * statistics)
+{
+	statistics->Capacity = _capacity;
+	statistics->CachedBlocks = 0;
+	statistics->BuffersInUse = 0;
+	for (uint32_t i = 0; i < _capacity; i++)
+	{
+		if (_buffers[i].Valid)
+		{
+			statistics->CachedBlocks++;
+		}
+		if (_buffers[i].RefCount > 0)
+		{
+			statistics->BuffersInUse++;
+		}
+	}
+	statistics->Hits = _hits;
+	statistics->Misses = _misses;
+	statistics->Evictions = _evictions;
+	statistics->ReadAhead = _readAhead;
+}
@@ -25,6 +25,7 @@ typedef struct _BootInfo
 	uint32_t	   StackTop;		// Location of the top of stack
 	uint32_t	   KernelSize;		// Size of the kernel in bytes
 	MemoryRegion * MemoryRegions;	// Pointer to the memory map returned by the BIOS
+	uint32_t	   MemoryRegionCount; // Number of entries in the memory map
 	uint8_t		   BootDevice;		// Id of boot device
 } BootInfo;
 
@@ -6,6 +6,11 @@
 #include <ctype.h>
 #include <fat12_functions.h>
 #include <userinterface.h>
+#include "physicalmemorymanager.h"
+#include "kernelheap.h"
+#include "virtualmemorymanager.h"
+#include "kernelspace.h"
+#include <blockcache.h>
 
 //The command prompt can be a max of 255 characters and is stored in PS1
 char PS1[255] = "Command>";
@@ -71,6 +76,22 @@ void InitialiseCommandsArray()
 	commandPtrs[commandNum] = &dbg;
 	++commandNum;
 	
+	commands[commandNum] = "MEMTRACE";
+	commandPtrs[commandNum] = &memtrace;
+	++commandNum;
+	
+	commands[commandNum] = "HEAPSTAT";
+	commandPtrs[commandNum] = &heapstat;
+	++commandNum;
+	
+	commands[commandNum] = "VMSTAT";
+	commandPtrs[commandNum] = &vmstat;
+	++commandNum;
+	
+	commands[commandNum] = "CACHESTAT";
+	commandPtrs[commandNum] = &cachestat;
+	++commandNum;
+	
 	
 	//Include a function to be called if the command string doesn't match any other
 	//This function MUST be last in the list and commandNum must NOT be incremented after it
@@ -79,7 +100,17 @@ void InitialiseCommandsArray()
 	commandPtrs[commandNum] = &incorrectFunction;
 }
 
+//Work done while the system is idle, before waiting for the next command
+void RunIdleTasks()
+{
+	//zero blocks for later allocations until the pool is full
+	while(PMM_RefillZeroedPool())
+	{
+	}
+}
+
 //Core loop: 
+//	Do any idle work
 //	Display the command prompt
 //	Read the next command from the console
 //	Execute said command
@@ -89,6 +120,7 @@ void Run()
 	char inputString[255] = "";
 	while(_running)
 	{
+		RunIdleTasks();
 		ConsoleWriteString(PS1);
 		ReadStringFromKeyboard(inputString);
 		ReactToCommand(inputString);
@@ -226,10 +258,16 @@ void readdisk(char* arguments)
 	
 	
 	//Read the requested sector and display it, periodically asking the user if they wish to cancel
-	uint8_t* sectorContents = FloppyDriveReadSector(sectorToRead);		
+	BlockBuffer* sectorContents = bread(FloppyDriveGetWorkingDrive(), sectorToRead);		
+	if(sectorContents == 0)
+	{
+		ConsoleWriteString("Unable to read sector\n");
+		return;
+	}
 	ConsoleWriteCharacter('\n');
 	InitialiseDisplayBuffer();
-	DisplayEntireBuffer(sectorContents, 512, displayAs);
+	DisplayEntireBuffer(sectorContents->Data, 512, displayAs);
+	brelse(sectorContents);
 	
 	ConsoleWriteString("\n");
 }
@@ -269,7 +307,6 @@ void showFileInfo(char* arguments)
 
 
 //display the contents of the specified file as text
-char dataBuffer[2048];
 uint16_t bufferSize = 2048;
 void read(char* arguments)
 {
@@ -279,32 +316,44 @@ void read(char* arguments)
 	
 	//	OPEN THE FILE
 	
-	FILE openedFile = FsFat12_Open(arguments);
+	PFILE openedFile = FsFat12_Open(arguments);
 	
-	if(openedFile.Flags != FS_FILE)
+	if(openedFile == 0 || openedFile->Flags != FS_FILE)
 	{
 		ConsoleWriteString("Specified File is not valid!\n");
+		FsFat12_Close(openedFile);
 		return;
 	}
 	
-	if(openedFile.FileLength == 0)
+	if(openedFile->FileLength == 0)
 	{
 		ConsoleWriteString("Specified File is empty.\n");
+		FsFat12_Close(openedFile);
 		return;
 	}
 	
 	
 	//	CONTINUOUSLY READ THE FILE AND DISPLAY IT UNTIL THE FILE ENDS OR THE USER CANCELS
+	
+	char* dataBuffer = kmalloc(bufferSize);
+	if(dataBuffer == 0)
+	{
+		ConsoleWriteString("Not enough memory to read the file!\n");
+		FsFat12_Close(openedFile);
+		return;
+	}
 		
 	InitialiseDisplayBuffer();
 	
 	unsigned int keepDisplaying = 1;
-	while(openedFile.Eof != 1 && keepDisplaying == 1)
+	while(openedFile->Eof != 1 && keepDisplaying == 1)
 	{
-		FsFat12_Read(&openedFile, dataBuffer, bufferSize);
+		FsFat12_Read(openedFile, dataBuffer, bufferSize);
 				
 		keepDisplaying = DisplayEntireBuffer(dataBuffer, bufferSize, CHAR);
 	}
+	kfree(dataBuffer);
+	FsFat12_Close(openedFile);
 	
 	
 	ConsoleWriteCharacter('\n');
@@ -415,6 +464,167 @@ void dbg(char* arguments)
 	ConsoleWriteCharacter('\n');
 }
 
+//Turn physical memory allocation tracing ON or OFF, or with no arguments
+//show which callers are holding the memory allocated since tracing started
+#define MEMTRACE_MAX_CALLSITES 16
+void memtrace(char* arguments)
+{
+	if(strcmp(arguments, "ON") == 0)
+	{
+		PMM_EnableTracing(true);
+		ConsoleWriteString("Memory tracing on.\n");
+		return;
+	}
+	if(strcmp(arguments, "OFF") == 0)
+	{
+		PMM_EnableTracing(false);
+		ConsoleWriteString("Memory tracing off.\n");
+		return;
+	}
+	if(arguments[0] != 0)
+	{
+		ConsoleWriteString("Usage: MEMTRACE [ON|OFF]\n");
+		return;
+	}
+	
+	ConsoleWriteString(PMM_IsTracing() ? "Memory tracing is on. " : "Memory tracing is off. ");
+	ConsoleWriteInt(PMM_GetTraceCount(), 10);
+	ConsoleWriteString(" calls traced.\n");
+	
+	PMM_TraceSummary summaries[MEMTRACE_MAX_CALLSITES];
+	uint32_t count = PMM_GetTraceSummary(summaries, MEMTRACE_MAX_CALLSITES);
+	if(count == 0)
+	{
+		ConsoleWriteString("No live allocations in the trace.\n");
+		return;
+	}
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		ConsoleWriteString("0x");
+		ConsoleWriteIntMinLength(summaries[i].CallSite, 16, 8);
+		ConsoleWriteString(": ");
+		ConsoleWriteInt(summaries[i].Allocations, 10);
+		ConsoleWriteString(" allocations, ");
+		ConsoleWriteInt(summaries[i].Blocks, 10);
+		ConsoleWriteString(" blocks\n");
+	}
+}
+
+//Display how much of the kernel heap is in use and how fragmented the free space is
+void heapstat(char* arguments)
+{
+	HeapStatistics statistics;
+	Heap_GetStatistics(&statistics);
+	
+	ConsoleWriteString("Heap size: ");
+	ConsoleWriteInt(statistics.HeapSize, 10);
+	ConsoleWriteString(" bytes\nIn use: ");
+	ConsoleWriteInt(statistics.UsedBytes, 10);
+	ConsoleWriteString(" bytes in ");
+	ConsoleWriteInt(statistics.AllocationCount, 10);
+	ConsoleWriteString(" blocks (peak ");
+	ConsoleWriteInt(statistics.PeakUsedBytes, 10);
+	ConsoleWriteString(" bytes)\nFree: ");
+	ConsoleWriteInt(statistics.FreeBytes, 10);
+	ConsoleWriteString(" bytes in ");
+	ConsoleWriteInt(statistics.FreeBlockCount, 10);
+	ConsoleWriteString(" blocks, largest ");
+	ConsoleWriteInt(statistics.LargestFreeBlock, 10);
+	ConsoleWriteString(" bytes\n");
+	
+	//Fragmentation is the share of free memory that is not in the largest free block
+	uint32_t fragmentation = 0;
+	uint32_t freeBytes = statistics.FreeBytes;
+	uint32_t largestFreeBlock = statistics.LargestFreeBlock;
+	if(freeBytes != 0)
+	{
+		//Scale down so that multiplying by 100 cannot overflow
+		while(freeBytes > 0x1000000)
+		{
+			freeBytes >>= 4;
+			largestFreeBlock >>= 4;
+		}
+		fragmentation = (freeBytes - largestFreeBlock) * 100 / freeBytes;
+	}
+	ConsoleWriteString("Fragmentation: ");
+	ConsoleWriteInt(fragmentation, 10);
+	ConsoleWriteString("%\n");
+}
+
+//Display statistics from the virtual memory manager
+void vmstat(char* arguments)
+{
+	ConsoleWriteString("Page directory switches: ");
+	ConsoleWriteInt(VMM_GetPageDirectorySwitchCount(), 10);
+	ConsoleWriteString("\nGlobal kernel pages: ");
+	ConsoleWriteInt(VMM_GetGlobalPageCount(), 10);
+	ConsoleWriteString("\nEstimated TLB flushes avoided: ");
+	ConsoleWriteInt(VMM_GetAvoidedTLBFlushCount(), 10);
+	ConsoleWriteString("\nSingle page TLB flushes: ");
+	ConsoleWriteInt(VMM_GetSinglePageFlushCount(), 10);
+	ConsoleWriteString("\nFull TLB flushes: ");
+	ConsoleWriteInt(VMM_GetFullTLBFlushCount(), 10);
+
+	PageFaultStatistics statistics;
+	VMM_GetPageFaultStatistics(&statistics);
+	ConsoleWriteString("\nMinor page faults: ");
+	ConsoleWriteInt(statistics.MinorFaults, 10);
+	ConsoleWriteString("\nCopy-on-write faults: ");
+	ConsoleWriteInt(statistics.CopyOnWriteFaults, 10);
+	ConsoleWriteString("\nBlocks committed to demand paged memory but not yet used: ");
+	ConsoleWriteInt(PMM_GetCommittedBlockCount(), 10);
+	ConsoleWriteString("\nPage fault handling: average ");
+	ConsoleWriteInt(statistics.AverageCycles, 10);
+	ConsoleWriteString(" cycles, longest ");
+	ConsoleWriteInt(statistics.MaximumCycles, 10);
+	ConsoleWriteString(" cycles\n");
+
+	ConsoleWriteString("Physical memory mapped at 0x");
+	ConsoleWriteInt(DIRECT_MAP_BASE, 16);
+	ConsoleWriteString(": ");
+	ConsoleWriteInt(VMM_GetDirectMapSize(), 10);
+	ConsoleWriteString(" bytes\n");
+
+	KernelSpaceStatistics space;
+	KernelSpace_GetStatistics(&space);
+	ConsoleWriteString("Kernel address space reserved: ");
+	ConsoleWriteInt(space.ReservedBytes, 10);
+	ConsoleWriteString(" bytes in ");
+	ConsoleWriteInt(space.ReservationCount, 10);
+	ConsoleWriteString(" ranges\nKernel address space free: ");
+	ConsoleWriteInt(space.FreeBytes, 10);
+	ConsoleWriteString(" bytes in ");
+	ConsoleWriteInt(space.FreeRangeCount, 10);
+	ConsoleWriteString(" ranges, largest ");
+	ConsoleWriteInt(space.LargestFreeRange, 10);
+	ConsoleWriteString(" bytes\n");
+}
+
+//Display statistics from the block cache
+void cachestat(char* arguments)
+{
+	BlockCacheStatistics statistics;
+	BlockCache_GetStatistics(&statistics);
+	ConsoleWriteString("Block cache: ");
+	ConsoleWriteInt(statistics.CachedBlocks, 10);
+	ConsoleWriteString(" of ");
+	ConsoleWriteInt(statistics.Capacity, 10);
+	ConsoleWriteString(" buffers holding blocks, ");
+	ConsoleWriteInt(statistics.BuffersInUse, 10);
+	ConsoleWriteString(" in use\nHits: ");
+	ConsoleWriteInt(statistics.Hits, 10);
+	ConsoleWriteString("\nMisses: ");
+	ConsoleWriteInt(statistics.Misses, 10);
+	ConsoleWriteString("\nEvictions: ");
+	ConsoleWriteInt(statistics.Evictions, 10);
+	ConsoleWriteString("\nRead with their track: ");
+	ConsoleWriteInt(statistics.ReadAhead, 10);
+	uint32_t reads = statistics.Hits + statistics.Misses;
+	ConsoleWriteString("\nHit rate: ");
+	ConsoleWriteInt(reads == 0 ? 0 : statistics.Hits * 100 / reads, 10);
+	ConsoleWriteString("%\n");
+}
+
 //Display an error in the event of an unrecognised command
 void incorrectFunction(char* arguments)
 {
@@ -4,6 +4,7 @@
 #include "exception.h"
 #include <hal.h>
 #include <console.h>
+#include "virtualmemorymanager.h"
 
 // For now, all of these interrupt handlers just disable hardware interrupts
 // and calls kernal_panic(). This displays an error and halts the system
@@ -101,11 +102,28 @@ void GeneralProtectionFault(unsigned int err)
 	for (;;);
 }
 
-// Page fault
+// Page fault. Faults on demand paged memory are handled by the virtual
+// memory manager, and the instruction that faulted is then run again.
 void PageFault(unsigned int err) 
 {
-	KernelPanic("Page Fault");
-	for (;;);
+	asm("pushal");
+
+	// The processor pushes the error code in place of a return address, so
+	// it is just above the saved frame pointer rather than where 'err' is
+	uint32_t errorCode;
+	asm volatile("movl 4(%%ebp), %0" : "=r"(errorCode));
+	if (!VMM_HandlePageFault(HAL_GetPageFaultAddress(), errorCode))
+	{
+		KernelPanic("Page Fault");
+		for (;;);
+	}
+
+	asm("popal");
+
+	// Remove the error code before returning via iret
+	asm("leave");
+	asm("addl $4, %esp");
+	asm("iret");
 }
 
 // Floating Point Unit (FPU) error
@@ -2,6 +2,8 @@
 #include <bpb.h>
 #include <console.h>
 #include <floppydisk.h>
+#include <blockcache.h>
+#include "slab.h"
 #include <_null.h>
 #include <string.h>
 
@@ -34,13 +36,21 @@ char currentDirectoryName[255];
 int currentDirStrLen;
 DirectoryEntry currentDirectory;
 
+//open files are allocated from their own slab cache
+SlabCache* fileCache;
+
 
 void FsFat12_Initialise()
 {
+	fileCache = Slab_CreateCache("FILE", sizeof(FILE), NULL);
+	
 	//Copy the BIOSParameter information into memory for future use
-	pBootSector bootSectorStart = (pBootSector)FloppyDriveReadSector(0);
+	BlockBuffer* bootBuffer = bread(FloppyDriveGetWorkingDrive(), 0);
+	if(bootBuffer == NULL) return;
+	pBootSector bootSectorStart = (pBootSector)bootBuffer->Data;
 	BIOSParamBlc = bootSectorStart->Bpb;
 	BIOSParamBlcExt = bootSectorStart->BpbExt;	
+	brelse(bootBuffer);
 	
 	
 	//store the index of the FAT, root, and data sectors
@@ -101,10 +111,18 @@ uint16_t FsFat12_GetFATEntry(int clusterNum)
 	int secondSector = secondByteIndex/BIOSParamBlc.BytesPerSector;
 	
 	//Read the two bytes from disk
-	uint8_t* readInSector = FloppyDriveReadSector(FATSector + firstSector);	
-	uint8_t firstByte = *(readInSector + firstByteIndex%BIOSParamBlc.BytesPerSector);	
-	if(firstSector != secondSector) readInSector = FloppyDriveReadSector(FATSector + secondSector);
-	uint8_t secondByte = *(readInSector + secondByteIndex%BIOSParamBlc.BytesPerSector);
+	uint8_t drive = FloppyDriveGetWorkingDrive();
+	BlockBuffer* readInSector = bread(drive, FATSector + firstSector);	
+	if(readInSector == NULL) return NULL;
+	uint8_t firstByte = readInSector->Data[firstByteIndex%BIOSParamBlc.BytesPerSector];	
+	if(firstSector != secondSector)
+	{
+		brelse(readInSector);
+		readInSector = bread(drive, FATSector + secondSector);
+		if(readInSector == NULL) return NULL;
+	}
+	uint8_t secondByte = readInSector->Data[secondByteIndex%BIOSParamBlc.BytesPerSector];
+	brelse(readInSector);
 		
 	
 	//extract the result from the two bytes
@@ -123,19 +141,19 @@ uint16_t FsFat12_GetFATEntry(int clusterNum)
 	return finalValue;
 }
 
-//read the requested cluster from the disk
+//read the requested cluster from the disk. The buffer must be given back with brelse
 //NOTE: This function assumes clusters and sectors are the same size
-uint8_t* FsFat12_ReadCluster(int cluster)
+BlockBuffer* FsFat12_ReadCluster(int cluster)
 {
 	if(INVALID_CLUSTER(cluster)) return NULL;
 	
-	return FloppyDriveReadSector(dataSector + cluster - 2);
+	return bread(FloppyDriveGetWorkingDrive(), dataSector + cluster - 2);
 }
 
 
 //return a file's n'th cluster (where n is the "clusterNumber" argument, and the file is determined by the firstCluster)
 //NOTE: This function assumes clusters and sectors are the same size
-uint8_t* FsFat12_GetNextClusterOfCurrentFile(int firstCluster, int clusterNumber)
+BlockBuffer* FsFat12_GetNextClusterOfCurrentFile(int firstCluster, int clusterNumber)
 {
 	uint16_t currentCluster = firstCluster;
 	
@@ -277,21 +295,22 @@ DirectoryEntry FsFat12_GetDirectoryEntryByIndex(int dirIndex, int sourceDirIniti
 	int clusterOffset = byteOffset/BIOSParamBlc.BytesPerSector;
 		
 	//read in the relevant sector from the floppy, treating the root directory differently to sub directories
-	uint8_t* sector;
+	BlockBuffer* sector;
 	if(sourceDirInitialCluster != 0) 
 		sector = FsFat12_GetNextClusterOfCurrentFile(sourceDirInitialCluster, clusterOffset);
 	else 
-		sector = FloppyDriveReadSector(rootSector + clusterOffset);
+		sector = bread(FloppyDriveGetWorkingDrive(), rootSector + clusterOffset);
 	
 	if(sector == NULL) return invalidDirectory;
 	
 	//calculate the offset within the current sector
 	byteOffset = byteOffset % BIOSParamBlc.BytesPerSector;
 	
-	//Move the pointer to the requested index
-	sector += byteOffset;
+	//Copy the entry at the requested index before giving the sector back
+	DirectoryEntry entry = *((DirectoryEntry*)(sector->Data + byteOffset));
+	brelse(sector);
 	
-	return *((DirectoryEntry*)sector);
+	return entry;
 }
 
 //return the directory entry with the specified name and extension from the directory starting in sector "sourceDirInitialSector"
@@ -455,18 +474,17 @@ void SetCurrentDirPath(const char* newPath)
 
 
 //given a filepath, retreive the directory entry it refers to and convert it into a FILE that is returned
-FILE FsFat12_Open(const char* filename)
+//returns NULL if the file does not exist or there is no memory for it. The FILE must be freed with FsFat12_Close
+PFILE FsFat12_Open(const char* filename)
 {
 	// GET THE DIRECTORY ENTRY
 	
 	DirectoryEntry resultingEntry = FsFat12_GetNestedDirectoryEntry(filename);
 		
-	FILE toReturn;	
-	if(INVALID_FILENAME(resultingEntry.Filename[0]))
-	{
-		toReturn.Flags = FS_INVALID;
-		return toReturn;
-	}	
+	if(INVALID_FILENAME(resultingEntry.Filename[0])) return NULL;
+	
+	PFILE file = (PFILE)Slab_Allocate(fileCache);
+	if(file == NULL) return NULL;
 	
 	
 	// SET UP THE FILE STRUCTURE
@@ -477,38 +495,38 @@ FILE FsFat12_Open(const char* filename)
 	{
 		if(resultingEntry.Filename[i] == ' ') break;	
 		
-		toReturn.Name[i] = resultingEntry.Filename[i];
+		file->Name[i] = resultingEntry.Filename[i];
 	}	
-	toReturn.Name[i] = 0;
+	file->Name[i] = 0;
 		
 	//handle subdirectories and files differently
 	if((resultingEntry.Attrib & DE_SUBDIR) == DE_SUBDIR)
 	{
-		toReturn.Flags = FS_DIRECTORY;
+		file->Flags = FS_DIRECTORY;
 	}
 	else
 	{
-		toReturn.Flags = FS_FILE;
+		file->Flags = FS_FILE;
 		
 		//copy across the file extension, up to the first space
-		toReturn.Name[i++] = '.';
+		file->Name[i++] = '.';
 		int j = 0;
 		for(; j < 3; ++j)
 		{
 			if(resultingEntry.Ext[j] == ' ') break;	
 			
-			toReturn.Name[i + j] = resultingEntry.Ext[j];
+			file->Name[i + j] = resultingEntry.Ext[j];
 		}		
-		toReturn.Name[i + j] = '\0';		
+		file->Name[i + j] = '\0';		
 	}
 		
-	toReturn.FileLength = resultingEntry.FileSize;	
-	toReturn.CurrentCluster = resultingEntry.FirstCluster;
+	file->FileLength = resultingEntry.FileSize;	
+	file->CurrentCluster = resultingEntry.FirstCluster;
 	
-	toReturn.Eof = 0;
-	toReturn.Position = 0;
+	file->Eof = 0;
+	file->Position = 0;
 	
-	return toReturn;
+	return file;
 }
 
 unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length)
@@ -518,7 +536,7 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
 	//				length is never larger than buffer
 
 	//store the last read sector
-	uint8_t* sector;
+	BlockBuffer* sector;
 	int amountToRead;
 	int totalRead = 0;
 	int remainingDist;
@@ -527,6 +545,12 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
 	while(totalRead < length)
 	{
 		sector = FsFat12_ReadCluster(file->CurrentCluster);
+		if(sector == NULL)
+		{
+			file->Eof = 1;
+			memset(buffer, 0, length - totalRead);
+			return totalRead;
+		}
 		
 		//if the amount space left to fill is less than a sector, only copy across the remainder
 		remainingDist = length - totalRead;
@@ -539,7 +563,8 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
 			amountToRead = BIOSParamBlc.BytesPerSector - file->Position;	
 		}
 		//copy the appropriate amount of data from the read in sector to the end of the buffer		
-		memcpy(buffer, sector + file->Position, amountToRead);
+		memcpy(buffer, sector->Data + file->Position, amountToRead);
+		brelse(sector);
 		
 		//keep track of how much data has been read in
 		file->Position += amountToRead;
@@ -554,7 +579,7 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
 		//if the final cluster has been reached then close the file, fill the rest of the buffer with null characters, and return
 		if(SPECIAL_CLUSTER(file->CurrentCluster))
 		{
-			FsFat12_Close(file);			
+			file->Eof = 1;
 			memset(buffer, 0, length - totalRead);			
 			return totalRead;
 		}
@@ -563,10 +588,12 @@ unsigned int FsFat12_Read(PFILE file, unsigned char* buffer, unsigned int length
 	return totalRead;
 }
 
-//close a given file
+//close a given file and free it
 void FsFat12_Close(PFILE file)
 {
+	if(file == NULL) return;
 	file->Eof = 1;
+	Slab_Free(fileCache, file);
 }
 
 
@@ -574,31 +601,33 @@ void FsFat12_Close(PFILE file)
 //given a full filepath, open the file and display various bits of information
 void FsFat12_GetEntryInfo(const char* entry)
 {	
-	FILE resultingFile = FsFat12_Open(entry);
+	PFILE resultingFile = FsFat12_Open(entry);
 	
-	if(resultingFile.Flags == FS_INVALID)
+	if(resultingFile == NULL)
 	{
 		ConsoleWriteString("File does not exist\n");
 		return;
 	}	
 	
 	ConsoleWriteString("FileName: ");
-	ConsoleWriteString(resultingFile.Name);
+	ConsoleWriteString(resultingFile->Name);
 	ConsoleWriteCharacter('\n');
 	
 	
 	ConsoleWriteString("File Type: ");
-	if(resultingFile.Flags == FS_DIRECTORY) ConsoleWriteString("Directory");
+	if(resultingFile->Flags == FS_DIRECTORY) ConsoleWriteString("Directory");
 	else ConsoleWriteString("File");
 	ConsoleWriteCharacter('\n');
 	
 	ConsoleWriteString("File Size: ");
-	ConsoleWriteInt(resultingFile.FileLength, 10);	
+	ConsoleWriteInt(resultingFile->FileLength, 10);	
 	ConsoleWriteCharacter('\n');
 	
 	ConsoleWriteString("First Cluster: ");
-	ConsoleWriteInt(resultingFile.CurrentCluster, 10);	
+	ConsoleWriteInt(resultingFile->CurrentCluster, 10);	
 	ConsoleWriteCharacter('\n');
+	
+	FsFat12_Close(resultingFile);
 }
 
 //return the current working directory string
@@ -686,24 +715,26 @@ void TESTGetFatEntry(int initialCluster)
 //Display the contents of the chosen cluster to the screen
 void TESTReadCluster(int cluster)
 {
-	uint8_t* readData = FsFat12_ReadCluster(cluster);
+	BlockBuffer* readData = FsFat12_ReadCluster(cluster);
 	if(readData == NULL) return;
 	for(int i = 0; i < 512; ++i)
 	{
-		ConsoleWriteCharacter(readData[i]);
+		ConsoleWriteCharacter(readData->Data[i]);
 	}
+	brelse(readData);
 }
 
 //Display the second and third sectors of the specified file
 void TESTGetNextClusterOfCurrentFile(int initialCluster, int destClustOffset)
 {	
 	//display the second cluster (cluster index 1)
-	uint8_t* readData = FsFat12_GetNextClusterOfCurrentFile(initialCluster, destClustOffset);
+	BlockBuffer* readData = FsFat12_GetNextClusterOfCurrentFile(initialCluster, destClustOffset);
 	if(readData == NULL) return;
 	for(int i = 0; i < 512; ++i)
 	{
-		ConsoleWriteCharacter(readData[i]);
+		ConsoleWriteCharacter(readData->Data[i]);
 	}
+	brelse(readData);
 }
 
 //Given a filepath display the extracted names and extensions
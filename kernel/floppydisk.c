@@ -1,5 +1,9 @@
+#include <string.h>
 #include <hal.h>
 #include <floppydisk.h>
+#include <blockcache.h>
+#include "physicalmemorymanager.h"
+#include "virtualmemorymanager.h"
 
 // Floppy disk support
 
@@ -88,9 +92,14 @@ const int FLOPPY_IRQ = 6;
 // Sectors per track
 const int FLPY_SECTORS_PER_TRACK = 18;
 
-// dma tranfer buffer starts here and ends at 0x8000+64k
-// You can change this as needed. It must be below 1MB and is a physical memory address
-int DMA_BUFFER = 0x8000;
+// Number of blocks in the DMA transfer buffer. It holds a whole track on both
+// heads, so that FloppyDriveReadTrack can read it in one command.
+#define FLPY_DMA_BUFFER_BLOCKS	((FLOPPY_TRACK_READ_SECTORS * 512 + 4095) / 4096)
+
+// DMA transfer buffer. This is a physical memory address below 16MB that does not
+// cross a 64K boundary. Unless it is set with FloppyDriveSetDMA, it is allocated
+// from the DMA zone when the driver is installed.
+int DMA_BUFFER = 0;
 
 // FDC uses DMA channel 2
 const int FDC_DMA_CHANNEL = 2;
@@ -98,8 +107,80 @@ const int FDC_DMA_CHANNEL = 2;
 // Current working drive. Defaults to 0 which should be fine on most systems
 static uint8_t	_CurrentDrive = 0;
 
-// Set when IRQ fires
-static volatile uint8_t _FloppyDiskIRQ = 0;
+// Number of clock ticks to wait for the controller to interrupt, and number
+// of times to poll it for a command or result byte, before giving up on it
+#define FLPY_IRQ_TIMEOUT_TICKS		100
+#define FLPY_FIFO_TIMEOUT_POLLS		100000
+
+// Number of times a request is tried before it fails, and number of times a
+// drive is told to recalibrate before that attempt fails. A recalibrate steps
+// the heads at most 77 times, so it can take two to get back from track 79.
+#define FLPY_REQUEST_ATTEMPTS		3
+#define FLPY_CALIBRATE_ATTEMPTS		10
+
+// Number of clock ticks to wait for the heads to settle after a seek
+#define FLPY_HEAD_SETTLE_TICKS		2
+
+// Number of clock ticks to wait for the motor to get up to speed, and the
+// default number of ticks the motor is left running after the last request
+#define FLPY_MOTOR_SPINUP_TICKS		20
+#define FLPY_MOTOR_IDLE_TICKS		200
+
+// Controller state. The controller is reset when the first request is made,
+// and after a command has failed or timed out, rather than before every read.
+typedef enum
+{
+	FLPY_CONTROLLER_NEEDS_RESET,
+	FLPY_CONTROLLER_READY
+} FloppyControllerState;
+
+static FloppyControllerState _ControllerState = FLPY_CONTROLLER_NEEDS_RESET;
+
+// What the driver is waiting for while it works on the request at the head
+// of the queue. The next step is taken from the floppy interrupt, or from a
+// timer callback for the motor and head settle delays, so nothing waits for
+// the drive.
+typedef enum
+{
+	FLPY_STATE_IDLE,			// The queue is empty
+	FLPY_STATE_RESETTING,		// Interrupt at the end of a reset
+	FLPY_STATE_SPINNING_UP,		// Timer for the motor to get up to speed
+	FLPY_STATE_CALIBRATING,		// Interrupt at the end of a recalibrate
+	FLPY_STATE_SEEKING,			// Interrupt at the end of a seek
+	FLPY_STATE_SETTLING,		// Timer for the heads to settle
+	FLPY_STATE_TRANSFERRING		// Interrupt at the end of a read or write
+} FloppyState;
+
+static volatile FloppyState _State = FLPY_STATE_IDLE;
+
+// Requests waiting to be carried out. The request at the head is the one
+// being worked on.
+static FloppyRequest *	_QueueHead = 0;
+static FloppyRequest *	_QueueTail = 0;
+
+// Number of times the current request has failed, and number of recalibrates
+// tried since the last reset
+static int _Attempts = 0;
+static int _CalibrateAttempts = 0;
+
+// Timer that fails the current step if its interrupt does not arrive, and
+// timer for the motor and head settle delays
+static int _WatchdogTimer = -1;
+static int _DelayTimer = -1;
+
+// Cylinder the heads of each drive are over, or -1 if it is not known and
+// the drive must be calibrated before it can seek
+static int _DriveCylinder[4] = { -1, -1, -1, -1 };
+
+// The motor is left running between requests, and turned off by a timer once
+// the drive has been idle for _MotorIdleTicks. _MotorDrive is the drive whose
+// motor is running, or -1 if none is.
+static volatile int _MotorDrive = -1;
+static int _MotorTimer = -1;
+static uint32_t _MotorIdleTicks = FLPY_MOTOR_IDLE_TICKS;
+
+// Buffer returned by FloppyDriveReadSector
+static uint8_t _SectorBuffer[512];
 
 typedef union
 {
@@ -130,7 +211,7 @@ bool FloppyDriveDMAInitialise(uint8_t* buffer, unsigned int length)
     DMA_ResetFlipflop(1);
 
     DMA_SetCount(FDC_DMA_CHANNEL, byteAccessableLength.byte[0], byteAccessableLength.byte[1]);
-	DMA_SetExternalPageRegister(2, 0);	
+	DMA_SetExternalPageRegister(FDC_DMA_CHANNEL, byteAccessableAddress.byte[2]);
 
     DMA_UnmaskChannel(FDC_DMA_CHANNEL);
     return true;
@@ -158,17 +239,37 @@ void FloppyDriveWriteToDOR(uint8_t val )
 	HAL_OutputByteToPort(FLPYDSK_DOR, val);
 }
 
+// Wait for the controller to be ready to transfer a byte through its FIFO.
+// If it does not become ready, it is reset before the next command.
+bool FloppyDriveWaitForFIFO() 
+{
+	for (int i = 0; i < FLPY_FIFO_TIMEOUT_POLLS; i++)
+	{
+		if (FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG)
+		{
+			return true;
+		}
+	}
+	_ControllerState = FLPY_CONTROLLER_NEEDS_RESET;
+	return false;
+}
+
 // Send command byte to floppy drive controller
 void FloppyDriveSendCommand(uint8_t cmd) 
 {
-	while (!(FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG));
-	HAL_OutputByteToPort(FLPYDSK_FIFO, cmd);
+	if (FloppyDriveWaitForFIFO())
+	{
+		HAL_OutputByteToPort(FLPYDSK_FIFO, cmd);
+	}
 }
 
 // Get data from floppy drive controller
 uint8_t FloppyDriveReadData() 
 {
-	while (!(FloppyDriveReadStatus() & FLPYDSK_MSR_MASK_DATAREG));
+	if (!FloppyDriveWaitForFIFO())
+	{
+		return 0xff;
+	}
 	return HAL_InputByteFromPort(FLPYDSK_FIFO);
 }
 
@@ -178,246 +279,443 @@ void FloppyDriveWriteToCCR(uint8_t val)
 	HAL_OutputByteToPort(FLPYDSK_CTRL, val);
 }
 
-//	Interrupt Handling Routines
+//	Controller Command Routines
 
-// Wait for IRQ to fire
-void FloppyDriveWaitForInterrupt() 
+// Check interrupt status command
+void FloppyDriveCheckInterruptStatus(uint32_t* st0, uint32_t* cyl) 
 {
-	while (_FloppyDiskIRQ == 0)
-	{
-		HAL_Sleep(1);
-	}
-	_FloppyDiskIRQ = 0;
+	FloppyDriveSendCommand(FDC_CMD_CHECK_INT);
+	*st0 = FloppyDriveReadData();
+	*cyl = FloppyDriveReadData();
 }
 
-// Floppy disk IRQ handler
-void I86_FloppyDriveInterruptHandler() 
+// Configure drive
+void FloppyDriveConfigure(uint8_t stepr, uint8_t loadt, uint8_t unloadt, bool dma ) 
 {
-	asm("pushal");
-	asm("cli");
+	uint8_t data = 0;
 
-	// Indicate IRQ fired
-	_FloppyDiskIRQ = 1;
+	FloppyDriveSendCommand(FDC_CMD_SPECIFY);
+	data = ((stepr & 0xf) << 4) | (unloadt & 0xf);
+	FloppyDriveSendCommand(data);
+	data = (( loadt << 1 ) | ( (dma) ? 0 : 1 ));
+	FloppyDriveSendCommand(data);
+}
 
-	// Tell HAL we are done
-	HAL_InterruptDone(FLOPPY_IRQ);
+// Disable controller
+void FloppyDriveDisableController() 
+{
+	FloppyDriveWriteToDOR(0);
+	_MotorDrive = -1;
+}
 
-	asm("sti");
-	asm("popal");
-	asm("leave");
-	asm("iret");
+//! enable controller
+void FloppyDriveEnableController() 
+{
+	FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA);
 }
 
-//	Controller Command Routines
+// Convert LBA to CHS
+void FloppyDriveLBAToCHS(int lba,int *head,int *track,int *sector) 
+{
+   *head = (lba % (FLPY_SECTORS_PER_TRACK * 2 )) / (FLPY_SECTORS_PER_TRACK);
+   *track = lba / (FLPY_SECTORS_PER_TRACK * 2 );
+   *sector = lba % FLPY_SECTORS_PER_TRACK + 1;
+}
 
-// Check interrupt status command
-void FloppyDriveCheckInterruptStatus(uint32_t* st0, uint32_t* cyl) 
+//	Motor Control
+//
+//	This and the state machine below are only run with interrupts disabled:
+//	from the interrupt handlers, from timer callbacks or from
+//	FloppyDriveSubmitRequest.
+
+// Turn on the motor of a drive and select it. Returns true if the motor was
+// already running, so there is no need to wait for it to spin up.
+bool FloppyDriveMotorOn(uint8_t drive) 
 {
-	FloppyDriveSendCommand(FDC_CMD_CHECK_INT);
-	*st0 = FloppyDriveReadData();
-	*cyl = FloppyDriveReadData();
+	if (_MotorDrive == drive)
+	{
+		return true;
+	}
+	// The motor bits for drives 0 to 3 follow each other in the DOR
+	uint8_t motor = (uint8_t)(FLPYDSK_DOR_MASK_DRIVE0_MOTOR << drive);
+	FloppyDriveWriteToDOR((uint8_t)(drive | motor | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
+	_MotorDrive = drive;
+	return false;
 }
 
-// Turn the current floppy drives motor on/off
-void FloppyDriveControlMotor(bool b) 
+// Turn off every motor. The controller is left enabled with its interrupt
+// on, since it is no longer reset before each command.
+void FloppyDriveMotorOff() 
 {
-	// Sanity check for invalid drive
-	if (_CurrentDrive > 3)
+	FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA);
+	_MotorDrive = -1;
+}
+
+// Called from the timer interrupt when the drive has been idle long enough
+void FloppyDriveMotorOffCallback() 
+{
+	_MotorTimer = -1;
+	if (_State == FLPY_STATE_IDLE)
 	{
-		return;
+		FloppyDriveMotorOff();
 	}
-	uint8_t motor = 0;
+}
 
-	//! select the correct mask based on current drive
-	switch (_CurrentDrive) 
+// Stop the motor being turned off
+void FloppyDriveCancelMotorOff() 
+{
+	// The timer must not fire between testing _MotorTimer and stopping it
+	bool enabled = HAL_SaveAndDisableInterrupts();
+	if (_MotorTimer >= 0)
 	{
-		case 0:
-			motor = FLPYDSK_DOR_MASK_DRIVE0_MOTOR;
-			break;
-		case 1:
-			motor = FLPYDSK_DOR_MASK_DRIVE1_MOTOR;
-			break;
-		case 2:
-			motor = FLPYDSK_DOR_MASK_DRIVE2_MOTOR;
-			break;
-		case 3:
-			motor = FLPYDSK_DOR_MASK_DRIVE3_MOTOR;
-			break;
+		HAL_StopTimer(_MotorTimer);
+		_MotorTimer = -1;
 	}
+	HAL_RestoreInterrupts(enabled);
+}
 
-	// Turn on or off the motor of that drive
-	if (b)
+// Turn the motor off once the drive has been idle for _MotorIdleTicks,
+// unless another request arrives before then
+void FloppyDriveScheduleMotorOff() 
+{
+	if (_MotorDrive < 0)
 	{
-		FloppyDriveWriteToDOR((uint8_t)(_CurrentDrive | motor | FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA));
+		return;
 	}
-	else
+	// The timer is armed and recorded in _MotorTimer with interrupts off, so
+	// that a short timer cannot fire and clear _MotorTimer before it is set
+	bool enabled = HAL_SaveAndDisableInterrupts();
+	FloppyDriveCancelMotorOff();
+	if (_MotorIdleTicks > 0)
+	{
+		_MotorTimer = HAL_StartTimer(_MotorIdleTicks, FloppyDriveMotorOffCallback);
+	}
+	if (_MotorTimer < 0)
 	{
-		FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET);
+		// There was no timer to use, so turn it off now
+		FloppyDriveMotorOff();
 	}
-	// In all cases, wait a little bit for the motor to spin up/turn off
-	HAL_Sleep(20);
+	HAL_RestoreInterrupts(enabled);
 }
 
-// Configure drive
-void FloppyDriveConfigure(uint8_t stepr, uint8_t loadt, uint8_t unloadt, bool dma ) 
-{
-	uint8_t data = 0;
+//	Request State Machine
 
-	FloppyDriveSendCommand(FDC_CMD_SPECIFY);
-	data = ((stepr & 0xf) << 4) | (unloadt & 0xf);
-	FloppyDriveSendCommand(data);
-	data = (( loadt << 1 ) | ( (dma) ? 0 : 1 ));
-	FloppyDriveSendCommand(data);
-}
+void FloppyDriveAdvance();
+void FloppyDriveFail();
 
-// Calibrate the drive
-int FloppyDriveCalibrate(uint8_t drive) 
+void FloppyDriveStopTimers() 
 {
-	uint32_t st0;
-	uint32_t cyl;
-
-	if (drive >= 4)
+	if (_WatchdogTimer >= 0)
 	{
-		return -2;
+		HAL_StopTimer(_WatchdogTimer);
+		_WatchdogTimer = -1;
 	}
-	// Turn on the motor
-	FloppyDriveControlMotor(true);
-	for (int i = 0; i < 10; i++) 
+	if (_DelayTimer >= 0)
 	{
-		FloppyDriveSendCommand(FDC_CMD_CALIBRATE);
-		FloppyDriveSendCommand( drive );
-		FloppyDriveWaitForInterrupt();
-		FloppyDriveCheckInterruptStatus( &st0, &cyl);
-
-		// Did we find cylinder 0? if so, we are done
-		if (!cyl) 
-		{
-			FloppyDriveControlMotor(false);
-			return 0;
-		}
+		HAL_StopTimer(_DelayTimer);
+		_DelayTimer = -1;
 	}
-	FloppyDriveControlMotor(false);
-	return -1;
 }
 
-// Disable controller
-void FloppyDriveDisableController() 
+// Called from the timer interrupt if the controller did not interrupt in time
+void FloppyDriveWatchdogCallback() 
 {
-	FloppyDriveWriteToDOR(0);
+	_WatchdogTimer = -1;
+	FloppyDriveFail();
 }
 
-//! enable controller
-void FloppyDriveEnableController() 
+// Called from the timer interrupt at the end of a delay
+void FloppyDriveDelayCallback() 
 {
-	FloppyDriveWriteToDOR(FLPYDSK_DOR_MASK_RESET | FLPYDSK_DOR_MASK_DMA);
+	_DelayTimer = -1;
+	FloppyDriveAdvance();
 }
 
-// Reset controller
-void FloppyDriveReset() 
+// Wait for the interrupt at the end of the command that has just been sent
+void FloppyDriveWaitForInterrupt(FloppyState state) 
 {
-	uint32_t st0;
-	uint32_t cyl;
-
-	FloppyDriveDisableController();
-	FloppyDriveEnableController();
-	FloppyDriveWaitForInterrupt();
-
-	// Send CHECK_INT/SENSE INTERRUPT command to all drives
-	for (int i=0; i<4; i++)
+	_State = state;
+	if (_ControllerState == FLPY_CONTROLLER_NEEDS_RESET)
 	{
-		FloppyDriveCheckInterruptStatus(&st0,&cyl);
+		// The command could not be sent
+		FloppyDriveFail();
+		return;
 	}
-	// Transfer speed 500kb/s
-	FloppyDriveWriteToCCR(0);
+	_WatchdogTimer = HAL_StartTimer(FLPY_IRQ_TIMEOUT_TICKS, FloppyDriveWatchdogCallback);
+}
 
-	// Pass mechanical drive info. steprate=3ms, unload time=240ms, load time=16ms
-	FloppyDriveConfigure(3,16,240,true);
+// Wait for a number of clock ticks before taking the next step
+void FloppyDriveDelay(FloppyState state, uint32_t ticks) 
+{
+	_State = state;
+	_DelayTimer = HAL_StartTimer(ticks, FloppyDriveDelayCallback);
+	if (_DelayTimer < 0)
+	{
+		// There was no timer to use, so carry on without the delay. If that
+		// makes the transfer fail, it is retried.
+		FloppyDriveAdvance();
+	}
+}
 
-	//! calibrate the disk
-	FloppyDriveCalibrate( _CurrentDrive );
+// Start on the request at the head of the queue, or let the motor stop if
+// there is none
+void FloppyDriveStartNext() 
+{
+	_Attempts = 0;
+	if (!_QueueHead)
+	{
+		_State = FLPY_STATE_IDLE;
+		FloppyDriveScheduleMotorOff();
+		return;
+	}
+	_QueueHead->Status = FLOPPY_REQUEST_ACTIVE;
+	FloppyDriveCancelMotorOff();
+	FloppyDriveAdvance();
 }
 
-// Read a sector
-void FloppyDriveReadSectorHTS(uint8_t head, uint8_t track, uint8_t sector) 
+// Take the request at the head of the queue off it, tell whoever made it
+// and move on to the next one
+void FloppyDriveComplete(FloppyRequestStatus status) 
 {
-	uint32_t st0;
-	uint32_t cyl;
+	FloppyRequest * request = _QueueHead;
+	_QueueHead = request->Next;
+	if (!_QueueHead)
+	{
+		_QueueTail = 0;
+	}
+	request->Next = 0;
+	request->Status = status;
+	if (request->Completion)
+	{
+		request->Completion(request);
+	}
+	FloppyDriveStartNext();
+}
 
-	// Initialize DMA
-	FloppyDriveDMAInitialise((uint8_t*)DMA_BUFFER, 512 );
+// The current step failed. Reset the controller and start the request again,
+// unless it has failed too many times already.
+void FloppyDriveFail() 
+{
+	FloppyDriveStopTimers();
+	_ControllerState = FLPY_CONTROLLER_NEEDS_RESET;
+	if (++_Attempts >= FLPY_REQUEST_ATTEMPTS)
+	{
+		FloppyDriveComplete(FLOPPY_REQUEST_FAILED);
+		return;
+	}
+	FloppyDriveAdvance();
+}
 
-	// Set the DMA for read transfer
-	DMA_SetRead(FDC_DMA_CHANNEL);
-	
-	// Read in a sector
-	FloppyDriveSendCommand(FDC_CMD_READ_SECT | FDC_CMD_EXT_MULTITRACK | FDC_CMD_EXT_SKIP | FDC_CMD_EXT_DENSITY);
-	FloppyDriveSendCommand(head << 2 | _CurrentDrive);
+// Start the read or write once the heads are over the right track. With the
+// multitrack bit set, a transfer that passes the last sector on head 0
+// carries on from sector 1 on head 1. The DMA count ends the command once
+// the requested number of sectors have been transferred.
+void FloppyDriveStartTransfer(FloppyRequest * request, uint8_t head, uint8_t track, uint8_t sector) 
+{
+	uint32_t length = request->Count * 512;
+	if (request->Write)
+	{
+		memcpy(phys_to_virt(DMA_BUFFER), request->Buffer, length);
+	}
+	if (!FloppyDriveDMAInitialise((uint8_t*)DMA_BUFFER, length))
+	{
+		// Trying again will not help
+		FloppyDriveComplete(FLOPPY_REQUEST_FAILED);
+		return;
+	}
+	if (request->Write)
+	{
+		DMA_SetWrite(FDC_DMA_CHANNEL);
+		FloppyDriveSendCommand(FDC_CMD_WRITE_SECT | FDC_CMD_EXT_MULTITRACK | FDC_CMD_EXT_DENSITY);
+	}
+	else
+	{
+		DMA_SetRead(FDC_DMA_CHANNEL);
+		FloppyDriveSendCommand(FDC_CMD_READ_SECT | FDC_CMD_EXT_MULTITRACK | FDC_CMD_EXT_SKIP | FDC_CMD_EXT_DENSITY);
+	}
+	FloppyDriveSendCommand(head << 2 | request->Drive);
 	FloppyDriveSendCommand(track);
 	FloppyDriveSendCommand(head);
 	FloppyDriveSendCommand(sector);
 	FloppyDriveSendCommand(FLPYDSK_SECTOR_DTL_512 );
-	uint8_t endSector = sector + 1;
-	if (endSector >= FLPY_SECTORS_PER_TRACK)
-	{
-		endSector = FLPY_SECTORS_PER_TRACK; 
-	}
-	FloppyDriveSendCommand(endSector);
+	FloppyDriveSendCommand(FLPY_SECTORS_PER_TRACK);
 	FloppyDriveSendCommand(FLPYDSK_GAP3_LENGTH_3_5 );
 	FloppyDriveSendCommand(0xff);
-	FloppyDriveWaitForInterrupt();
-	
-	// Read status info
-	for (int j=0; j<7; j++)
+	FloppyDriveWaitForInterrupt(FLPY_STATE_TRANSFERRING);
+}
+
+// Take the next step towards carrying out the request at the head of the
+// queue. Anything that is already done, such as the heads being on the right
+// track, is skipped.
+void FloppyDriveAdvance() 
+{
+	FloppyRequest * request = _QueueHead;
+	uint8_t drive = request->Drive;
+	int head = 0;
+	int	track = 0;
+	int sector = 1;
+	FloppyDriveLBAToCHS(request->Sector, &head, &track, &sector);
+
+	if (_ControllerState == FLPY_CONTROLLER_NEEDS_RESET)
 	{
-		FloppyDriveReadData();
+		// A reset loses track of where the heads are on every drive, and
+		// turns off the motors
+		for (int i = 0; i < 4; i++)
+		{
+			_DriveCylinder[i] = -1;
+		}
+		_ControllerState = FLPY_CONTROLLER_READY;
+		_CalibrateAttempts = 0;
+		FloppyDriveDisableController();
+		FloppyDriveEnableController();
+		FloppyDriveWaitForInterrupt(FLPY_STATE_RESETTING);
+		return;
+	}
+	if (!FloppyDriveMotorOn(drive))
+	{
+		FloppyDriveDelay(FLPY_STATE_SPINNING_UP, FLPY_MOTOR_SPINUP_TICKS);
+		return;
+	}
+	if (_DriveCylinder[drive] < 0)
+	{
+		if (_CalibrateAttempts++ == FLPY_CALIBRATE_ATTEMPTS)
+		{
+			FloppyDriveFail();
+			return;
+		}
+		FloppyDriveSendCommand(FDC_CMD_CALIBRATE);
+		FloppyDriveSendCommand(drive);
+		FloppyDriveWaitForInterrupt(FLPY_STATE_CALIBRATING);
+		return;
+	}
+	if (_DriveCylinder[drive] != track)
+	{
+		FloppyDriveSendCommand(FDC_CMD_SEEK);
+		FloppyDriveSendCommand((uint8_t)(head << 2 | drive));
+		FloppyDriveSendCommand((uint8_t)track);
+		FloppyDriveWaitForInterrupt(FLPY_STATE_SEEKING);
+		return;
 	}
-	// Let FDC know we handled interrupt
-	FloppyDriveCheckInterruptStatus(&st0,&cyl);
+	FloppyDriveStartTransfer(request, (uint8_t)head, (uint8_t)track, (uint8_t)sector);
 }
 
-// Seek to given track/cylinder
-int FloppyDriveSeek(uint8_t cyl, uint8_t head) 
+// Handle an interrupt from the controller
+void FloppyDriveInterrupt() 
 {
 	uint32_t st0;
-	uint32_t cyl0;
+	uint32_t cyl;
 
-	if (_CurrentDrive >= 4)
+	if (_State != FLPY_STATE_RESETTING && _State != FLPY_STATE_CALIBRATING &&
+		_State != FLPY_STATE_SEEKING && _State != FLPY_STATE_TRANSFERRING)
 	{
-		return -1;
+		// Nothing is waiting for it, for example because the command
+		// timed out
+		return;
 	}
-	for (int i = 0; i < 10; i++ ) 
+	FloppyDriveStopTimers();
+	FloppyRequest * request = _QueueHead;
+	switch (_State)
 	{
-		FloppyDriveSendCommand(FDC_CMD_SEEK);
-		FloppyDriveSendCommand((head) << 2 | _CurrentDrive);
-		FloppyDriveSendCommand(cyl);
-		FloppyDriveWaitForInterrupt();
-		FloppyDriveCheckInterruptStatus(&st0,&cyl0);
-		if (cyl0 == cyl)
+		case FLPY_STATE_RESETTING:
+			// Send CHECK_INT/SENSE INTERRUPT command to all drives
+			for (int i = 0; i < 4; i++)
+			{
+				FloppyDriveCheckInterruptStatus(&st0, &cyl);
+			}
+			// Transfer speed 500kb/s
+			FloppyDriveWriteToCCR(0);
+			// Pass mechanical drive info. steprate=3ms, load time=2ms, unload time=240ms
+			FloppyDriveConfigure(13, 1, 0xf, true);
+			break;
+
+		case FLPY_STATE_CALIBRATING:
+			// Did we find cylinder 0? If not, the drive is told to recalibrate again
+			FloppyDriveCheckInterruptStatus(&st0, &cyl);
+			if (cyl == 0)
+			{
+				_DriveCylinder[request->Drive] = 0;
+			}
+			break;
+
+		case FLPY_STATE_SEEKING:
 		{
-			// We have found the cylinder
-			return 0;
+			uint32_t track = request->Sector / FLOPPY_TRACK_READ_SECTORS;
+			FloppyDriveCheckInterruptStatus(&st0, &cyl);
+			if (_ControllerState == FLPY_CONTROLLER_NEEDS_RESET || cyl != track)
+			{
+				_DriveCylinder[request->Drive] = -1;
+				FloppyDriveFail();
+				return;
+			}
+			_DriveCylinder[request->Drive] = track;
+			FloppyDriveDelay(FLPY_STATE_SETTLING, FLPY_HEAD_SETTLE_TICKS);
+			return;
 		}
+
+		default:
+		{
+			// Read status info. The top two bits of ST0 are 0 if the command
+			// completed normally. Reading the result bytes clears the interrupt,
+			// so there must not be a sense interrupt command here.
+			uint8_t status = FloppyDriveReadData();
+			for (int j = 1; j < 7; j++)
+			{
+				FloppyDriveReadData();
+			}
+			if (_ControllerState == FLPY_CONTROLLER_NEEDS_RESET || (status & 0xc0) != 0)
+			{
+				FloppyDriveFail();
+				return;
+			}
+			if (!request->Write)
+			{
+				memcpy(request->Buffer, phys_to_virt(DMA_BUFFER), request->Count * 512);
+			}
+			FloppyDriveComplete(FLOPPY_REQUEST_DONE);
+			return;
+		}
+	}
+	if (_ControllerState == FLPY_CONTROLLER_NEEDS_RESET)
+	{
+		FloppyDriveFail();
+		return;
 	}
-	return -1;
+	FloppyDriveAdvance();
 }
 
-// Convert LBA to CHS
-void FloppyDriveLBAToCHS(int lba,int *head,int *track,int *sector) 
+// Floppy disk IRQ handler
+void I86_FloppyDriveInterruptHandler() 
 {
-   *head = (lba % (FLPY_SECTORS_PER_TRACK * 2 )) / (FLPY_SECTORS_PER_TRACK);
-   *track = lba / (FLPY_SECTORS_PER_TRACK * 2 );
-   *sector = lba % FLPY_SECTORS_PER_TRACK + 1;
+	asm("pushal");
+	asm("cli");
+
+	FloppyDriveInterrupt();
+
+	// Tell HAL we are done
+	HAL_InterruptDone(FLOPPY_IRQ);
+
+	asm("sti");
+	asm("popal");
+	asm("leave");
+	asm("iret");
 }
 
 // Install floppy driver
 void FloppyDriveInstall(int irq) 
 {
+	// Allocate a buffer for DMA transfers if we have not been given one
+	if (DMA_BUFFER == 0)
+	{
+		DMA_BUFFER = (int)PMM_AllocateBlocksInZone(PMM_ZONE_DMA, FLPY_DMA_BUFFER_BLOCKS);
+		if (DMA_BUFFER != 0)
+		{
+			PMM_SetBlockOwner((void*)DMA_BUFFER, FLPY_DMA_BUFFER_BLOCKS, PMM_OWNER_DMA);
+		}
+	}
 	// Install interrupt handler
 	HAL_SetInterruptVector(irq, I86_FloppyDriveInterruptHandler);
-	// Reset the floppy drive controller
-	FloppyDriveReset();
-	// Set drive information
-	FloppyDriveConfigure(13, 1, 0xf, true);
+	// The controller is reset when the first request is made
+	_ControllerState = FLPY_CONTROLLER_NEEDS_RESET;
 }
 
 // Set current working drive
@@ -435,39 +733,106 @@ uint8_t FloppyDriveGetWorkingDrive()
 	return _CurrentDrive;
 }
 
-// read a sector
-int lastReadSector = -1;
-uint8_t* FloppyDriveReadSector(int sectorLBA) 
+// Set how long the motor keeps running after the last request
+void FloppyDriveSetMotorIdleTime(uint32_t ticks) 
+{
+	_MotorIdleTicks = ticks;
+}
+
+// Add a request to the queue
+bool FloppyDriveSubmitRequest(FloppyRequest * request) 
 {
-	//modification to speed things up a bit. No need to re-read a buffer that's already in memory.
-	//This will cause problems if the buffer is modified from outside but currently this should never happen
-	if(sectorLBA == lastReadSector) return (uint8_t*)DMA_BUFFER;
-	lastReadSector = sectorLBA;
-	
-	// The following line is put it because we were
-	// encountering problems under Bochs when we do a seek
-	// following a read - the seek command could not be sent.
-	FloppyDriveReset();
-	if (_CurrentDrive >= 4)
+	if (!request || request->Drive >= 4 || request->Count == 0 || !request->Buffer || DMA_BUFFER == 0)
 	{
-		return 0;
+		return false;
 	}
-	// Convert LBA sector to CHS
-	int head = 0;
-	int	track = 0;
-	int sector = 1;
-	FloppyDriveLBAToCHS(sectorLBA, &head, &track, &sector);
-	// Turn motor on and seek to track on both heads
-	FloppyDriveControlMotor(true);
-	if (FloppyDriveSeek((uint8_t)track, (uint8_t)head) != 0)
+	// The DMA buffer holds one track, so a request cannot go past the end of one
+	uint32_t track = request->Sector / FLOPPY_TRACK_READ_SECTORS;
+	if ((request->Sector + request->Count - 1) / FLOPPY_TRACK_READ_SECTORS != track)
 	{
-		return 0;
+		return false;
+	}
+	request->Status = FLOPPY_REQUEST_QUEUED;
+	request->Next = 0;
+	if (request->Write)
+	{
+		// Requests are carried out in order, so a read through the cache
+		// that is queued after this one sees the new data
+		request->CacheGeneration = BlockCache_InvalidateRange(request->Drive, request->Sector, request->Count);
 	}
-	HAL_Sleep(10);
-	// Read sector and turn motor off
-	FloppyDriveReadSectorHTS((uint8_t)head, (uint8_t)track, (uint8_t)sector);
-	FloppyDriveControlMotor(false);
 
-	return (uint8_t*)DMA_BUFFER;
+	bool enabled = HAL_SaveAndDisableInterrupts();
+	if (_QueueTail)
+	{
+		_QueueTail->Next = request;
+	}
+	else
+	{
+		_QueueHead = request;
+	}
+	_QueueTail = request;
+	if (_State == FLPY_STATE_IDLE)
+	{
+		FloppyDriveStartNext();
+	}
+	HAL_RestoreInterrupts(enabled);
+	return true;
 }
 
+// Wait for a request to finish
+bool FloppyDriveWaitForRequest(FloppyRequest * request) 
+{
+	// Interrupts are enabled and the processor halted in one step, so the
+	// interrupt that completes the request cannot arrive in between
+	HAL_DisableInterrupts();
+	while (request->Status == FLOPPY_REQUEST_QUEUED || request->Status == FLOPPY_REQUEST_ACTIVE)
+	{
+		asm volatile("sti\n\t"
+					 "hlt\n\t"
+					 "cli");
+	}
+	HAL_EnableInterrupts();
+	if (request->Status != FLOPPY_REQUEST_DONE)
+	{
+		return false;
+	}
+	if (request->Write)
+	{
+		// The cache cannot be changed from the interrupt handler, so written
+		// blocks are put in it here
+		BlockCache_Update(request->Drive, request->Sector, request->Count, request->Buffer, request->CacheGeneration);
+	}
+	return true;
+}
+
+// Read sectors from the working drive and wait for them
+bool FloppyDriveReadSectors(int sectorLBA, uint32_t count, uint8_t* buffer) 
+{
+	FloppyRequest request;
+	request.Drive = _CurrentDrive;
+	request.Sector = sectorLBA;
+	request.Count = count;
+	request.Buffer = buffer;
+	request.Write = false;
+	request.Completion = 0;
+	request.Context = 0;
+	return FloppyDriveSubmitRequest(&request) && FloppyDriveWaitForRequest(&request);
+}
+
+// read a sector
+uint8_t* FloppyDriveReadSector(int sectorLBA) 
+{
+	if (!FloppyDriveReadSectors(sectorLBA, 1, _SectorBuffer))
+	{
+		return 0;
+	}
+	return _SectorBuffer;
+}
+
+// Read a whole track on both heads
+bool FloppyDriveReadTrack(int track, uint8_t* buffer) 
+{
+	// Start at sector 1 on head 0. The read carries on to head 1, so the
+	// whole track takes two turns of the disk rather than one per sector.
+	return FloppyDriveReadSectors(track * FLOPPY_TRACK_READ_SECTORS, FLOPPY_TRACK_READ_SECTORS, buffer);
+}
@@ -19,6 +19,19 @@ int I86_CPU_Initialise()
 	// initialise processor tables
 	I86_GDT_Initialise();
 	I86_IDT_Initialise(0x8);
+	// Turn on SSE if we have it, so that the kernel can use it for
+	// moving and clearing memory
+	if (I86_CPU_GetFeatures() & I86_CPU_FEATURE_SSE2)
+	{
+		asm volatile("movl %%cr0, %%eax \n\t"
+					 "andl $0xFFFFFFFB, %%eax \n\t"	// Clear EM
+					 "orl  $0x2, %%eax \n\t"			// Set MP
+					 "movl %%eax, %%cr0 \n\t"
+					 "movl %%cr4, %%eax \n\t"
+					 "orl  $0x600, %%eax \n\t"		// Set OSFXSR and OSXMMEXCPT
+					 "movl %%eax, %%cr4"
+					 : : : "eax");
+	}
 	return 0;
 }
 
@@ -44,3 +57,16 @@ char * I86_CPU_GetVendor()
 				 :[vendor] "D" (vendor));
 	return vendor;
 }
+
+// Returns the feature flags of the CPU
+
+uint32_t I86_CPU_GetFeatures() 
+{
+	uint32_t features;
+
+	asm volatile("cpuid" 
+				 : "=d" (features) 
+				 : "a" (1) 
+				 : "ebx", "ecx");
+	return features;
+}
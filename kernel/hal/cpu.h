@@ -13,4 +13,9 @@ void I86_CPU_Shutdown();
 // Get cpu vender
 char * I86_CPU_GetVendor();
 
+// Get cpu feature flags (EDX from CPUID function 1)
+uint32_t I86_CPU_GetFeatures();
+
+#define I86_CPU_FEATURE_SSE2	(1 << 26)
+
 #endif
@@ -106,6 +106,25 @@ void  HAL_DisableInterrupts()
 }
 
 
+// Disable interrupts, returning whether they were enabled
+bool HAL_SaveAndDisableInterrupts()
+{
+	uint32_t flags;
+	asm volatile("pushfl\n\t"
+				 "popl %0\n\t"
+				 "cli" : "=r"(flags) : : "memory");
+	return (flags & 0x200) != 0;
+}
+
+// Enable interrupts again if they were enabled before
+void HAL_RestoreInterrupts(bool enabled)
+{
+	if (enabled)
+	{
+		asm("sti");
+	}
+}
+
 // Sets new interrupt vector
 void  HAL_SetInterruptVector (int intno, void (*vect)() ) 
 {
@@ -139,6 +158,12 @@ const char*  HAL_GetCPUVendor()
 	return I86_CPU_GetVendor();
 }
 
+// Returns cpu feature flags
+uint32_t HAL_GetCPUFeatures() 
+{
+	return I86_CPU_GetFeatures();
+}
+
 // Return current tick count 
 uint32_t HAL_GetTickCount() 
 {
@@ -156,6 +181,18 @@ void HAL_Sleep(uint32_t tickCount)
 	while (ticks > HAL_GetTickCount());
 }
 
+// Start a one-shot timer
+int HAL_StartTimer(uint32_t tickCount, void (*callback)())
+{
+	return I86_PIT_StartTimer(tickCount, callback);
+}
+
+// Stop a timer before it fires
+void HAL_StopTimer(int timer)
+{
+	I86_PIT_StopTimer(timer);
+}
+
 void HAL_EnablePaging() 
 {
 	asm volatile("movl %cr0, %eax \n\t"
@@ -171,6 +208,45 @@ void HAL_DisablePaging()
 	
 }
 
+void HAL_EnableLargePages()
+{
+	asm volatile("movl %%cr4, %%eax \n\t"
+				 "orl  $0x10, %%eax\n\t"
+				 "movl %%eax, %%cr4" : : : "eax");
+}
+
+void HAL_EnableGlobalPages()
+{
+	asm volatile("movl %%cr4, %%eax \n\t"
+				 "orl  $0x80, %%eax\n\t"
+				 "movl %%eax, %%cr4" : : : "eax");
+}
+
+void HAL_EnableWriteProtection()
+{
+	asm volatile("movl %%cr0, %%eax \n\t"
+				 "orl  $0x10000, %%eax\n\t"
+				 "movl %%eax, %%cr0" : : : "eax");
+}
+
+void HAL_FlushTLB()
+{
+	// Loading CR3 leaves global pages in the TLB. Turning global pages off
+	// and back on flushes everything, so do that if they are on.
+	asm volatile("movl %%cr4, %%eax \n\t"
+				 "testl $0x80, %%eax\n\t"
+				 "jz   1f \n\t"
+				 "andl $~0x80, %%eax\n\t"
+				 "movl %%eax, %%cr4 \n\t"
+				 "orl  $0x80, %%eax\n\t"
+				 "movl %%eax, %%cr4 \n\t"
+				 "jmp  2f \n\t"
+				 "1: \n\t"
+				 "movl %%cr3, %%eax \n\t"
+				 "movl %%eax, %%cr3 \n\t"
+				 "2:" : : : "eax", "cc", "memory");
+}
+
 bool HAL_IsPaging() 
 {
 	uint32_t res=0;
@@ -191,3 +267,19 @@ uint32_t HAL_GetPageDirectoryBaseRegister()
 	asm volatile("movl %%cr3, %0" : "=r"(addr));
 	return addr;
 }
+
+uint32_t HAL_GetPageFaultAddress()
+{
+	uint32_t addr = 0;
+
+	asm volatile("movl %%cr2, %0" : "=r"(addr));
+	return addr;
+}
+
+uint64_t HAL_ReadTimeStampCounter()
+{
+	uint64_t count;
+
+	asm volatile("rdtsc" : "=A"(count));
+	return count;
+}
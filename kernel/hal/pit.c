@@ -20,6 +20,33 @@ static volatile uint32_t			_pit_ticks = 0;
 // Test if pit is initialized
 static bool							_pit_IsInitialised = false;
 
+// One-shot timers. A timer is free when its callback is 0.
+
+#define		I86_PIT_MAX_TIMERS			8
+
+typedef struct _I86_PIT_Timer
+{
+	uint32_t	Expires;			// Tick count at which the callback is called
+	void		(*Callback)();
+} I86_PIT_Timer;
+
+static volatile I86_PIT_Timer		_pit_timers[I86_PIT_MAX_TIMERS];
+
+// Call the callbacks of any timers that have expired
+void I86_PIT_RunTimers()
+{
+	for (int i = 0; i < I86_PIT_MAX_TIMERS; i++)
+	{
+		void (*callback)() = _pit_timers[i].Callback;
+		// Compare the difference so that the tick count wrapping round does not matter
+		if (callback && (int32_t)(_pit_ticks - _pit_timers[i].Expires) >= 0)
+		{
+			_pit_timers[i].Callback = 0;
+			callback();
+		}
+	}
+}
+
 //	PIT timer interrupt handler
 void  I86_PIT_TimerInterruptHandler() 
 {
@@ -33,6 +60,8 @@ void  I86_PIT_TimerInterruptHandler()
 	// Increment tick count
 	_pit_ticks++;
 
+	I86_PIT_RunTimers();
+
 	// Tell hal we are done
 	HAL_InterruptDone(0);
 
@@ -62,6 +91,38 @@ uint32_t I86_PIT_HAL_GetTickCount()
 	return _pit_ticks;
 }
 
+// Start a one-shot timer
+int I86_PIT_StartTimer(uint32_t ticks, void (*callback)())
+{
+	if (!callback)
+	{
+		return -1;
+	}
+	int timer = -1;
+	bool enabled = HAL_SaveAndDisableInterrupts();
+	for (int i = 0; i < I86_PIT_MAX_TIMERS; i++)
+	{
+		if (!_pit_timers[i].Callback)
+		{
+			_pit_timers[i].Expires = _pit_ticks + ticks;
+			_pit_timers[i].Callback = callback;
+			timer = i;
+			break;
+		}
+	}
+	HAL_RestoreInterrupts(enabled);
+	return timer;
+}
+
+// Stop a timer that has not expired yet
+void I86_PIT_StopTimer(int timer)
+{
+	if (timer >= 0 && timer < I86_PIT_MAX_TIMERS)
+	{
+		_pit_timers[timer].Callback = 0;
+	}
+}
+
 // Send command to pit
 void I86_PIT_SendCommand(uint8_t cmd) 
 {
@@ -53,6 +53,13 @@ uint32_t I86_PIT_SetTickCount(uint32_t i);
 // Return current tick count
 uint32_t I86_PIT_HAL_GetTickCount();
 
+// Call 'callback' from the timer interrupt once 'ticks' ticks have passed.
+// Returns the timer, or -1 if there is no free timer.
+int I86_PIT_StartTimer(uint32_t ticks, void (*callback)());
+
+// Stop a timer before its callback has been called
+void I86_PIT_StopTimer(int timer);
+
 // Start a counter. Counter continues until another call to this routine
 void I86_PIT_StartCounter(uint32_t freq, uint8_t counter, uint8_t mode);
 
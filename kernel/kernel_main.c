@@ -7,11 +7,24 @@
 #include "exception.h"
 #include "physicalmemorymanager.h"
 #include "virtualmemorymanager.h"
+#include "kernelspace.h"
+#include "kernelheap.h"
+#include "slab.h"
 #include "bootinfo.h"
 #include "fat12_functions.h"
+#include <blockcache.h>
 
 BootInfo *	_bootInfo;
 
+// Set to true to report the throughput of the physical memory manager during boot
+
+#define REPORT_PMM_BENCHMARK	false
+
+// Number of disk blocks kept in the block cache. Each miss reads a whole
+// track of 36 blocks, so this keeps a few tracks.
+
+#define BLOCK_CACHE_BUFFERS		128
+
 // This is a dummy __main.  For some reason, gcc puts in a call to 
 // __main from main, so we just include a dummy.
  
@@ -54,6 +67,14 @@ void InitialisePhysicalMemory()
 		memoryMapAddress = (memoryMapAddress / PMM_GetBlockSize() + 1) * PMM_GetBlockSize();
 	}
 	uint32_t sizeOfMemoryMap = PMM_Initialise(_bootInfo, memoryMapAddress);
+	if (PMM_GetUnmanagedMemorySize() > 0)
+	{
+		// The PMM's data has to fit in the first 4MB, which limits how much
+		// memory it can manage
+		ConsoleWriteString("Warning: ");
+		ConsoleWriteInt(PMM_GetUnmanagedMemorySize(), 10);
+		ConsoleWriteString("K of memory is not used\n");
+	}
 
 	// We now need to mark various regions as unavailable
 	
@@ -63,15 +84,32 @@ void InitialisePhysicalMemory()
 	// Mark memory used by kernel as unavailable
 	PMM_MarkRegionAsUnavailable(0x100000, _bootInfo->KernelSize);
 
-	// Mark memory used by memory map as unavailable
+	// Mark memory used by memory map (and the boot arena that follows it) as unavailable
 	PMM_MarkRegionAsUnavailable(PMM_GetMemoryMap(), sizeOfMemoryMap);
 
 	// Reserve two blocks for the stack and make unavailable (the stack is set at 0x90000 in boot loader)
 	uint32_t stackSize = PMM_GetBlockSize() * 2;
 	PMM_MarkRegionAsUnavailable(_bootInfo->StackTop - stackSize, stackSize);
-	
-	// Reserve block used for DMA transfers
-	PMM_MarkRegionAsUnavailable(0x8000, 4096);
+
+	// The boot information is still read after this point, so keep it safe from
+	// allocations from low memory
+	PMM_MarkRegionAsUnavailable((uint32_t)_bootInfo, sizeof(BootInfo));
+}
+
+// Report the rate at which the physical memory manager can allocate
+// blocks as memory fills up
+
+void ReportPhysicalMemoryBenchmark()
+{
+	uint32_t occupancies[] = { 10, 50, 95 };
+	for (int i = 0; i < 3; i++)
+	{
+		ConsoleWriteString("PMM allocations per second at ");
+		ConsoleWriteInt(occupancies[i], 10);
+		ConsoleWriteString("% occupancy: ");
+		ConsoleWriteInt(PMM_MeasureAllocationRate(occupancies[i]), 10);
+		ConsoleWriteString("\n");
+	}
 }
 
 void Initialise()
@@ -83,9 +121,18 @@ void Initialise()
 	HAL_Initialise();
 	InitialiseInterrupts();
 	InitialisePhysicalMemory();
+	if (REPORT_PMM_BENCHMARK)
+	{
+		ReportPhysicalMemoryBenchmark();
+	}
 	// Switch to using our own page tables, rather than the temporary
 	// ones created by the boot loader
 	VMM_Initialise();
+	// The kernel heap and slabs reserve their own ranges of kernel addresses
+	KernelSpace_Initialise();
+	Heap_Initialise();
+	Slab_Initialise();
+	BlockCache_Initialise(BLOCK_CACHE_BUFFERS);
 	// Install keyboard driver
 	KeyboardInstall(33);
 	// Set boot drive as current drive
@@ -94,11 +141,15 @@ void Initialise()
 	FloppyDriveInstall(38);
 	//Initialise the FAT12 filesystem
 	FsFat12_Initialise();
+	// Nothing reads the ACPI tables, so their memory can be used now
+	PMM_ReclaimBootMemory();
 }
 
 void main(BootInfo * bootInfo) 
 {
 	_bootInfo = bootInfo;
 	Initialise();
+	// Anything set up in the boot arena is finished with now
+	PMM_ReleaseBootArena();
 	Run();
 }
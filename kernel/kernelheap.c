@@ -0,0 +1,350 @@
+// Kernel Heap
+//
+// The heap lives in its own range of virtual addresses, which is demand
+// paged. Growing the heap commits memory for the new pages, and each page
+// is given a block from the physical memory manager the first time it is
+// touched. Since the memory is committed when the heap grows, running out
+// of memory makes kmalloc fail rather than the page fault handler.
+//
+// Every block starts with a header and ends with a footer (boundary tags)
+// that both hold the size of the block in bytes, with bit 0 set if the
+// block is in use. Sizes include the tags and are a multiple of 8. When a
+// block is freed, the tags let it be merged with the blocks on either side
+// of it in constant time.
+//
+// Free blocks are kept on segregated free lists. Small blocks have one list
+// per size, so a small allocation is either a pop from the list for its size
+// or a pop from the first non-empty list above it. Larger blocks have one
+// list for each power of two.
+
+#include <string.h>
+#include <bitops.h>
+#include "kernelheap.h"
+#include "virtualmemorymanager.h"
+#include "physicalmemorymanager.h"
+#include "kernelspace.h"
+
+// Amount of kernel address space reserved for the heap
+
+#define HEAP_SIZE				0x10000000
+
+#define HEAP_PAGE_SIZE			4096
+
+// Amount the heap is created with and the least it grows by
+
+#define HEAP_INITIAL_SIZE		0x4000
+#define HEAP_GROW_SIZE			0x4000
+
+// A free block needs room for its header, footer and list pointers
+
+#define HEAP_MINIMUM_BLOCK		16
+
+#define HEAP_TAG_SIZE			4
+#define HEAP_USED				1
+
+// Blocks of up to HEAP_SMALL_LIMIT bytes have a list for each multiple of
+// 8. Above that, there is a list for each power of two up to the size of
+// the heap's address range.
+
+#define HEAP_SMALL_LIMIT		512
+#define HEAP_SMALL_CLASSES		((HEAP_SMALL_LIMIT - HEAP_MINIMUM_BLOCK) / 8 + 1)
+#define HEAP_SMALL_LIMIT_LOG2	9
+#define HEAP_CLASS_COUNT		(HEAP_SMALL_CLASSES + 28 - HEAP_SMALL_LIMIT_LOG2 + 1)
+#define HEAP_CLASS_WORDS		((HEAP_CLASS_COUNT + 31) / 32)
+
+// The layout of a free block. Allocated blocks only have the header and the
+// footer; the rest is given to the caller.
+
+typedef struct _HeapFreeBlock
+{
+	uint32_t				Size;
+	struct _HeapFreeBlock *	Next;
+	struct _HeapFreeBlock *	Previous;
+} HeapFreeBlock;
+
+static	HeapFreeBlock *	_freeLists[HEAP_CLASS_COUNT];
+
+// A bit is set for each free list that is not empty
+
+static	uint32_t		_nonEmptyClasses[HEAP_CLASS_WORDS];
+
+// Range of addresses reserved for the heap, and the end of the part of it
+// that is in use
+
+static	uint32_t		_heapStart = 0;
+static	uint32_t		_heapLimit = 0;
+static	uint32_t		_heapEnd = 0;
+
+static	uint32_t		_usedBytes = 0;
+static	uint32_t		_peakUsedBytes = 0;
+static	uint32_t		_allocationCount = 0;
+
+// Private functions
+
+// Return the free list that a block of 'size' bytes belongs on
+
+uint32_t HeapClassForSize(uint32_t size)
+{
+	if (size <= HEAP_SMALL_LIMIT)
+	{
+		return (size - HEAP_MINIMUM_BLOCK) / 8;
+	}
+	return HEAP_SMALL_CLASSES + BitScanReverse(size) - HEAP_SMALL_LIMIT_LOG2;
+}
+
+// Write the header and footer of a block
+
+static inline void HeapSetTags(uint32_t block, uint32_t size, uint32_t used)
+{
+	*(uint32_t*)block = size | used;
+	*(uint32_t*)(block + size - HEAP_TAG_SIZE) = size | used;
+}
+
+void HeapInsertFreeBlock(HeapFreeBlock * block, uint32_t size)
+{
+	uint32_t class = HeapClassForSize(size);
+	HeapSetTags((uint32_t)block, size, 0);
+	block->Previous = 0;
+	block->Next = _freeLists[class];
+	if (block->Next)
+	{
+		block->Next->Previous = block;
+	}
+	_freeLists[class] = block;
+	_nonEmptyClasses[class / 32] |= 1 << (class % 32);
+}
+
+void HeapRemoveFreeBlock(HeapFreeBlock * block)
+{
+	uint32_t class = HeapClassForSize(block->Size);
+	if (block->Previous)
+	{
+		block->Previous->Next = block->Next;
+	}
+	else
+	{
+		_freeLists[class] = block->Next;
+		if (!block->Next)
+		{
+			_nonEmptyClasses[class / 32] &= ~(1 << (class % 32));
+		}
+	}
+	if (block->Next)
+	{
+		block->Next->Previous = block->Previous;
+	}
+}
+
+// Return the first class at or above 'class' that has a free block, or
+// HEAP_CLASS_COUNT if there is none
+
+uint32_t HeapFindNonEmptyClass(uint32_t class)
+{
+	while (class < HEAP_CLASS_COUNT)
+	{
+		uint32_t word = _nonEmptyClasses[class / 32] & (0xFFFFFFFF << (class % 32));
+		if (word != 0)
+		{
+			return (class & ~31) + BitScanForward(word);
+		}
+		class = (class & ~31) + 32;
+	}
+	return HEAP_CLASS_COUNT;
+}
+
+// Merge a block that has become free with any free neighbours and put the
+// result on a free list
+
+void HeapReleaseBlock(uint32_t block, uint32_t size)
+{
+	uint32_t next = *(uint32_t*)(block + size);
+	if (!(next & HEAP_USED))
+	{
+		HeapRemoveFreeBlock((HeapFreeBlock*)(block + size));
+		size += next;
+	}
+	uint32_t previous = *(uint32_t*)(block - HEAP_TAG_SIZE);
+	if (!(previous & HEAP_USED))
+	{
+		block -= previous;
+		HeapRemoveFreeBlock((HeapFreeBlock*)block);
+		size += previous;
+	}
+	HeapInsertFreeBlock((HeapFreeBlock*)block, size);
+}
+
+// Commit at least 'size' more bytes onto the end of the heap and add them
+// to the free lists. Returns false if no memory could be added.
+
+bool HeapGrow(uint32_t size)
+{
+	uint32_t needed = (size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+	if (size < HEAP_GROW_SIZE)
+	{
+		size = HEAP_GROW_SIZE;
+	}
+	size = (size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+	if (size > _heapLimit - _heapEnd)
+	{
+		size = _heapLimit - _heapEnd;
+	}
+	if (size == 0)
+	{
+		return false;
+	}
+	// If there is not enough memory for the whole amount, commit just what
+	// was asked for
+	if (!VMM_CommitDemandRegion(_heapStart, size))
+	{
+		if (needed >= size || !VMM_CommitDemandRegion(_heapStart, needed))
+		{
+			return false;
+		}
+		size = needed;
+	}
+	if (_heapEnd == _heapStart)
+	{
+		// The heap starts with a footer and ends with a header that are
+		// marked as in use, so that blocks are never merged past either end.
+		// The first block then starts 4 bytes into the heap, which puts the
+		// memory handed out on an 8 byte boundary.
+		*(uint32_t*)_heapStart = HEAP_USED;
+		_heapEnd += size;
+		*(uint32_t*)(_heapEnd - HEAP_TAG_SIZE) = HEAP_USED;
+		HeapInsertFreeBlock((HeapFreeBlock*)(_heapStart + HEAP_TAG_SIZE), size - 2 * HEAP_TAG_SIZE);
+		return true;
+	}
+	// The new memory becomes a block that starts where the end header was
+	uint32_t block = _heapEnd - HEAP_TAG_SIZE;
+	_heapEnd += size;
+	*(uint32_t*)(_heapEnd - HEAP_TAG_SIZE) = HEAP_USED;
+	HeapReleaseBlock(block, size);
+	return true;
+}
+
+// Find a free block of at least 'size' bytes and take it off its free list.
+// Returns 0 if there is none.
+
+HeapFreeBlock * HeapTakeFreeBlock(uint32_t size)
+{
+	uint32_t class = HeapClassForSize(size);
+	if (class >= HEAP_SMALL_CLASSES)
+	{
+		// Blocks on the list for this power of two may be too small, so
+		// look for the first one that fits
+		for (HeapFreeBlock * block = _freeLists[class]; block; block = block->Next)
+		{
+			if (block->Size >= size)
+			{
+				HeapRemoveFreeBlock(block);
+				return block;
+			}
+		}
+		class++;
+	}
+	// Every block on the lists from here on is big enough
+	class = HeapFindNonEmptyClass(class);
+	if (class == HEAP_CLASS_COUNT)
+	{
+		return 0;
+	}
+	HeapFreeBlock * block = _freeLists[class];
+	HeapRemoveFreeBlock(block);
+	return block;
+}
+
+// Public functions
+
+void Heap_Initialise()
+{
+	memset(_freeLists, 0, sizeof(_freeLists));
+	memset(_nonEmptyClasses, 0, sizeof(_nonEmptyClasses));
+	_usedBytes = 0;
+	_peakUsedBytes = 0;
+	_allocationCount = 0;
+	_heapStart = KernelSpace_Reserve(HEAP_SIZE);
+	_heapLimit = _heapStart ? _heapStart + HEAP_SIZE : 0;
+	_heapEnd = _heapStart;
+	if (!_heapStart || !VMM_AddDemandRegion(_heapStart, HEAP_SIZE, I86_PTE_WRITABLE))
+	{
+		// With no addresses to grow into, every allocation fails
+		_heapLimit = _heapStart;
+		return;
+	}
+	HeapGrow(HEAP_INITIAL_SIZE);
+}
+
+void* kmalloc(size_t size)
+{
+	if (size == 0 || size > HEAP_SIZE)
+	{
+		return 0;
+	}
+	uint32_t blockSize = ((size + 7) & ~7) + 2 * HEAP_TAG_SIZE;
+	if (blockSize < HEAP_MINIMUM_BLOCK)
+	{
+		blockSize = HEAP_MINIMUM_BLOCK;
+	}
+	HeapFreeBlock * block = HeapTakeFreeBlock(blockSize);
+	if (!block)
+	{
+		if (!HeapGrow(blockSize) || !(block = HeapTakeFreeBlock(blockSize)))
+		{
+			return 0;
+		}
+	}
+	// Give back whatever is left over if it is big enough to be a block
+	uint32_t remaining = block->Size - blockSize;
+	if (remaining >= HEAP_MINIMUM_BLOCK)
+	{
+		HeapInsertFreeBlock((HeapFreeBlock*)((uint32_t)block + blockSize), remaining);
+	}
+	else
+	{
+		blockSize = block->Size;
+	}
+	HeapSetTags((uint32_t)block, blockSize, HEAP_USED);
+	_usedBytes += blockSize;
+	if (_usedBytes > _peakUsedBytes)
+	{
+		_peakUsedBytes = _usedBytes;
+	}
+	_allocationCount++;
+	return (void*)((uint32_t)block + HEAP_TAG_SIZE);
+}
+
+void kfree(void* p)
+{
+	if (!p)
+	{
+		return;
+	}
+	uint32_t block = (uint32_t)p - HEAP_TAG_SIZE;
+	uint32_t size = *(uint32_t*)block & ~7;
+	_usedBytes -= size;
+	_allocationCount--;
+	HeapReleaseBlock(block, size);
+}
+
+void Heap_GetStatistics(HeapStatistics * statistics)
+{
+	statistics->HeapSize = _heapEnd - _heapStart;
+	statistics->UsedBytes = _usedBytes;
+	statistics->PeakUsedBytes = _peakUsedBytes;
+	statistics->AllocationCount = _allocationCount;
+	statistics->FreeBytes = 0;
+	statistics->FreeBlockCount = 0;
+	statistics->LargestFreeBlock = 0;
+	for (uint32_t class = 0; class < HEAP_CLASS_COUNT; class++)
+	{
+		for (HeapFreeBlock * block = _freeLists[class]; block; block = block->Next)
+		{
+			statistics->FreeBytes += block->Size;
+			statistics->FreeBlockCount++;
+			if (block->Size > statistics->LargestFreeBlock)
+			{
+				statistics->LargestFreeBlock = block->Size;
+			}
+		}
+	}
+}
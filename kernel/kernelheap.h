@@ -0,0 +1,39 @@
+#ifndef _KERNELHEAP_H
+#define _KERNELHEAP_H
+
+// Kernel Heap
+
+#include <size_t.h>
+#include <stdint.h>
+
+// Statistics reported by Heap_GetStatistics
+
+typedef struct _HeapStatistics
+{
+	uint32_t	HeapSize;			// Bytes of virtual memory the heap has grown to
+	uint32_t	UsedBytes;			// Bytes in allocated blocks, including their tags
+	uint32_t	PeakUsedBytes;		// Highest value UsedBytes has reached
+	uint32_t	FreeBytes;			// Bytes in free blocks
+	uint32_t	FreeBlockCount;		// Number of free blocks
+	uint32_t	LargestFreeBlock;	// Size of the largest free block in bytes
+	uint32_t	AllocationCount;	// Number of blocks currently allocated
+} HeapStatistics;
+
+// Initialise the kernel heap. Paging must already be enabled.
+
+void Heap_Initialise();
+
+// Allocate 'size' bytes from the kernel heap. The memory is aligned on an
+// 8 byte boundary. Returns 0 if there is not enough memory.
+
+void* kmalloc(size_t size);
+
+// Free memory allocated by kmalloc
+
+void kfree(void* p);
+
+// Get statistics about the kernel heap
+
+void Heap_GetStatistics(HeapStatistics * statistics);
+
+#endif
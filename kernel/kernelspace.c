@@ -0,0 +1,383 @@
+// Kernel Virtual Address Space
+//
+// Keeps track of which kernel virtual addresses are in use, so that the
+// heap, slabs and anything else that needs a range of addresses of its own
+// can reserve one rather than picking it by hand.
+//
+// Free ranges are kept in an AVL tree ordered by address. Each node also
+// holds the size of the largest free range below it, so the lowest free
+// range that is big enough can be found in O(log n) by walking down from
+// the root. Released ranges are merged with the free ranges either side of
+// them, so the higher half does not fragment as ranges come and go.
+//
+// Every reservation is followed by a guard page that is never mapped, so
+// running off the end of one range faults rather than corrupting the next.
+
+#include <string.h>
+#include "kernelspace.h"
+#include "virtualmemorymanager.h"
+
+// The first 4MB above 0xC0000000 holds the kernel. The addresses at the top
+// hold the direct map of physical memory and the page tables.
+
+#define KSPACE_START			0xC0400000
+#define KSPACE_END				DIRECT_MAP_BASE
+
+#define KSPACE_PAGE_SIZE		4096
+#define KSPACE_GUARD_SIZE		KSPACE_PAGE_SIZE
+
+// Number of tree nodes. There is one node for each free range, so this is
+// enough for over 200 reservations however they are released.
+
+#define KSPACE_MAX_RANGES		256
+
+typedef struct _FreeRange
+{
+	uint32_t				Start;
+	uint32_t				Size;
+	uint32_t				LargestBelow;	// Largest Size in this subtree, including this node
+	uint32_t				Height;
+	struct _FreeRange *		Left;
+	struct _FreeRange *		Right;
+} FreeRange;
+
+static	FreeRange		_ranges[KSPACE_MAX_RANGES];
+
+// Nodes that are not in the tree, linked through Left
+
+static	FreeRange *		_unusedRanges = 0;
+
+static	FreeRange *		_root = 0;
+
+static	uint32_t		_freeRangeCount = 0;
+static	uint32_t		_reservedBytes = 0;
+static	uint32_t		_reservationCount = 0;
+
+// AVL tree helpers. Functions that change a subtree return its new root.
+
+uint32_t RangeHeight(FreeRange * range)
+{
+	return range ? range->Height : 0;
+}
+
+uint32_t RangeLargest(FreeRange * range)
+{
+	return range ? range->LargestBelow : 0;
+}
+
+// Recalculate the height and largest size of a node from its children
+
+void RangeUpdate(FreeRange * range)
+{
+	uint32_t leftHeight = RangeHeight(range->Left);
+	uint32_t rightHeight = RangeHeight(range->Right);
+	range->Height = (leftHeight > rightHeight ? leftHeight : rightHeight) + 1;
+	uint32_t largest = range->Size;
+	if (RangeLargest(range->Left) > largest)
+	{
+		largest = RangeLargest(range->Left);
+	}
+	if (RangeLargest(range->Right) > largest)
+	{
+		largest = RangeLargest(range->Right);
+	}
+	range->LargestBelow = largest;
+}
+
+FreeRange * RangeRotateRight(FreeRange * range)
+{
+	FreeRange * left = range->Left;
+	range->Left = left->Right;
+	left->Right = range;
+	RangeUpdate(range);
+	RangeUpdate(left);
+	return left;
+}
+
+FreeRange * RangeRotateLeft(FreeRange * range)
+{
+	FreeRange * right = range->Right;
+	range->Right = right->Left;
+	right->Left = range;
+	RangeUpdate(range);
+	RangeUpdate(right);
+	return right;
+}
+
+// Restore the balance of a node whose subtrees differ in height by at most 2
+
+FreeRange * RangeBalance(FreeRange * range)
+{
+	RangeUpdate(range);
+	uint32_t leftHeight = RangeHeight(range->Left);
+	uint32_t rightHeight = RangeHeight(range->Right);
+	if (leftHeight > rightHeight + 1)
+	{
+		if (RangeHeight(range->Left->Right) > RangeHeight(range->Left->Left))
+		{
+			range->Left = RangeRotateLeft(range->Left);
+		}
+		return RangeRotateRight(range);
+	}
+	if (rightHeight > leftHeight + 1)
+	{
+		if (RangeHeight(range->Right->Left) > RangeHeight(range->Right->Right))
+		{
+			range->Right = RangeRotateRight(range->Right);
+		}
+		return RangeRotateLeft(range);
+	}
+	return range;
+}
+
+FreeRange * RangeInsert(FreeRange * root, FreeRange * range)
+{
+	if (!root)
+	{
+		range->Left = 0;
+		range->Right = 0;
+		RangeUpdate(range);
+		return range;
+	}
+	if (range->Start < root->Start)
+	{
+		root->Left = RangeInsert(root->Left, range);
+	}
+	else
+	{
+		root->Right = RangeInsert(root->Right, range);
+	}
+	return RangeBalance(root);
+}
+
+// Take the lowest node out of a subtree and return it in 'minimum'
+
+FreeRange * RangeRemoveMinimum(FreeRange * root, FreeRange ** minimum)
+{
+	if (!root->Left)
+	{
+		*minimum = root;
+		return root->Right;
+	}
+	root->Left = RangeRemoveMinimum(root->Left, minimum);
+	return RangeBalance(root);
+}
+
+// Take the node for the range starting at 'start' out of a subtree
+
+FreeRange * RangeRemove(FreeRange * root, uint32_t start)
+{
+	if (!root)
+	{
+		return 0;
+	}
+	if (start < root->Start)
+	{
+		root->Left = RangeRemove(root->Left, start);
+	}
+	else if (start > root->Start)
+	{
+		root->Right = RangeRemove(root->Right, start);
+	}
+	else
+	{
+		if (!root->Right)
+		{
+			return root->Left;
+		}
+		FreeRange * successor;
+		FreeRange * right = RangeRemoveMinimum(root->Right, &successor);
+		successor->Left = root->Left;
+		successor->Right = right;
+		root = successor;
+	}
+	return RangeBalance(root);
+}
+
+// Find the lowest free range of at least 'size' bytes
+
+FreeRange * RangeFindFit(uint32_t size)
+{
+	FreeRange * range = _root;
+	if (RangeLargest(range) < size)
+	{
+		return 0;
+	}
+	for (;;)
+	{
+		if (RangeLargest(range->Left) >= size)
+		{
+			range = range->Left;
+		}
+		else if (range->Size >= size)
+		{
+			return range;
+		}
+		else
+		{
+			range = range->Right;
+		}
+	}
+}
+
+// Find the free ranges immediately before and after an address
+
+void RangeFindNeighbours(uint32_t address, FreeRange ** before, FreeRange ** after)
+{
+	*before = 0;
+	*after = 0;
+	FreeRange * range = _root;
+	while (range)
+	{
+		if (range->Start < address)
+		{
+			*before = range;
+			range = range->Right;
+		}
+		else
+		{
+			*after = range;
+			range = range->Left;
+		}
+	}
+}
+
+FreeRange * RangeGetUnused()
+{
+	FreeRange * range = _unusedRanges;
+	if (range)
+	{
+		_unusedRanges = range->Left;
+	}
+	return range;
+}
+
+void RangePutUnused(FreeRange * range)
+{
+	range->Left = _unusedRanges;
+	_unusedRanges = range;
+}
+
+// Public functions
+
+void KernelSpace_Initialise()
+{
+	_unusedRanges = 0;
+	for (int i = KSPACE_MAX_RANGES - 1; i >= 0; i--)
+	{
+		RangePutUnused(&_ranges[i]);
+	}
+	FreeRange * range = RangeGetUnused();
+	range->Start = KSPACE_START;
+	range->Size = KSPACE_END - KSPACE_START;
+	_root = RangeInsert(0, range);
+	_freeRangeCount = 1;
+	_reservedBytes = 0;
+	_reservationCount = 0;
+}
+
+uint32_t KernelSpace_Reserve(uint32_t size)
+{
+	if (size == 0 || size > KSPACE_END - KSPACE_START)
+	{
+		return 0;
+	}
+	size = (size + KSPACE_PAGE_SIZE - 1) & ~(KSPACE_PAGE_SIZE - 1);
+	uint32_t needed = size + KSPACE_GUARD_SIZE;
+	FreeRange * range = RangeFindFit(needed);
+	if (!range)
+	{
+		return 0;
+	}
+	// Take the reservation from the bottom of the free range. What is left
+	// keeps its place in the order, but its size has changed, so it is put
+	// back into the tree to update the sizes above it.
+	uint32_t address = range->Start;
+	_root = RangeRemove(_root, address);
+	if (range->Size == needed)
+	{
+		RangePutUnused(range);
+		_freeRangeCount--;
+	}
+	else
+	{
+		range->Start += needed;
+		range->Size -= needed;
+		_root = RangeInsert(_root, range);
+	}
+	_reservedBytes += size;
+	_reservationCount++;
+	return address;
+}
+
+void KernelSpace_Release(uint32_t address, uint32_t size)
+{
+	if (address < KSPACE_START || size == 0)
+	{
+		return;
+	}
+	size = (size + KSPACE_PAGE_SIZE - 1) & ~(KSPACE_PAGE_SIZE - 1);
+	uint32_t released = size + KSPACE_GUARD_SIZE;
+	if (released > KSPACE_END - address)
+	{
+		return;
+	}
+	FreeRange * before;
+	FreeRange * after;
+	RangeFindNeighbours(address, &before, &after);
+	if ((before && before->Start + before->Size > address) ||
+		(after && address + released > after->Start))
+	{
+		// Part of the range is already free
+		return;
+	}
+	FreeRange * range = 0;
+	if (before && before->Start + before->Size == address)
+	{
+		// Grow the range before to cover this one
+		_root = RangeRemove(_root, before->Start);
+		range = before;
+		range->Size += released;
+	}
+	if (after && address + released == after->Start)
+	{
+		_root = RangeRemove(_root, after->Start);
+		if (range)
+		{
+			// This range joins the ranges either side of it into one
+			range->Size += after->Size;
+			RangePutUnused(after);
+			_freeRangeCount--;
+		}
+		else
+		{
+			range = after;
+			range->Start = address;
+			range->Size += released;
+		}
+	}
+	if (!range)
+	{
+		range = RangeGetUnused();
+		if (!range)
+		{
+			// There is no node to record it with, so the range stays reserved
+			return;
+		}
+		range->Start = address;
+		range->Size = released;
+		_freeRangeCount++;
+	}
+	_root = RangeInsert(_root, range);
+	_reservedBytes -= size;
+	_reservationCount--;
+}
+
+void KernelSpace_GetStatistics(KernelSpaceStatistics * statistics)
+{
+	statistics->ReservedBytes = _reservedBytes;
+	statistics->ReservationCount = _reservationCount;
+	statistics->FreeBytes = KSPACE_END - KSPACE_START - _reservedBytes - _reservationCount * KSPACE_GUARD_SIZE;
+	statistics->FreeRangeCount = _freeRangeCount;
+	statistics->LargestFreeRange = RangeLargest(_root);
+}
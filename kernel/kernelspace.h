@@ -0,0 +1,39 @@
+#ifndef _KERNELSPACE_H
+#define _KERNELSPACE_H
+
+// Kernel Virtual Address Space
+
+#include <stdint.h>
+
+// Statistics reported by KernelSpace_GetStatistics
+
+typedef struct _KernelSpaceStatistics
+{
+	uint32_t	ReservedBytes;		// Bytes reserved, not including guard pages
+	uint32_t	ReservationCount;	// Number of ranges currently reserved
+	uint32_t	FreeBytes;			// Bytes not reserved
+	uint32_t	FreeRangeCount;		// Number of separate free ranges
+	uint32_t	LargestFreeRange;	// Size of the largest free range in bytes
+} KernelSpaceStatistics;
+
+// Initialise the kernel address space allocator. Everything above the
+// kernel and below the direct map of physical memory starts off free.
+
+void KernelSpace_Initialise();
+
+// Reserve 'size' bytes of kernel virtual addresses, rounded up to a whole
+// number of pages. Nothing is mapped there. Returns 0 if there is no free
+// range big enough.
+
+uint32_t KernelSpace_Reserve(uint32_t size);
+
+// Release a range returned by KernelSpace_Reserve. 'size' must be the size
+// it was reserved with. Anything still mapped in the range is not unmapped.
+
+void KernelSpace_Release(uint32_t address, uint32_t size);
+
+// Get statistics about the kernel address space
+
+void KernelSpace_GetStatistics(KernelSpaceStatistics * statistics);
+
+#endif
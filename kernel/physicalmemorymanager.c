@@ -1,12 +1,19 @@
 // Physical Memory Manager
 
 #include <string.h>
+#include <hal.h>
+#include <bitops.h>
 #include "physicalmemorymanager.h"
 
 // Each byte in the memory map indicates 8 blocks of memory
 
 #define PMM_BLOCKS_PER_BYTE 	8
 
+// log2 of the block size, for dividing 64-bit addresses without a call
+// to the compiler's runtime library
+
+#define PMM_BLOCK_SHIFT			12
+
 // Blocks are alligned on block size boundaries
 
 #define PMM_BLOCK_ALIGNMENT		PMM_BLOCK_SIZE
@@ -18,300 +25,1902 @@ static	uint32_t	_physicalMemorySize = 0;
 // number of blocks currently in use
 static	uint32_t	_usedBlocks = 0;
 
+// Number of free blocks promised to PMM_AllocateCommittedBlock by
+// PMM_CommitBlocks. Other allocations leave this many blocks free.
+
+static	uint32_t	_committedBlocks = 0;
+
 // maximum number of available memory blocks
 
 static	uint32_t	_maximumBlockCount = 0;
 
+// Number of available blocks left out because the PMM's data has no room
+// to describe them
+
+static	uint32_t	_unmanagedBlocks = 0;
+
 // Memory map bit array. Each bit represents a memory block
 
 static	uint32_t*	_memoryMap = 0;
 
 static uint32_t 	_memoryMapSize = 0;
 
-// Private functions
+// Summary levels kept above a bitmap. Each bit in the first summary level
+// indicates that the corresponding dword of the bitmap has at least one bit
+// set, each bit in the next level indicates that the corresponding dword of
+// the level below is non-zero, and so on until a level fits into a single
+// dword. Three levels are enough to cover the full 4GB address space.
 
-// Set any bit within the memory map bit array
-//
-// This marks the block as being in use
+#define PMM_MAX_SUMMARY_LEVELS	3
 
-void MemoryMapSetBit(uint32_t bit) 
+// A bitmap together with its summary levels. Levels[0] is the bitmap itself.
+
+typedef struct _SummaryBitmap
 {
-	_memoryMap[bit / 32] |= (1 << (bit % 32));
-}
+	uint32_t*	Levels[PMM_MAX_SUMMARY_LEVELS + 1];
+	uint32_t	Words[PMM_MAX_SUMMARY_LEVELS + 1];
+	uint32_t	LevelCount;
+} SummaryBitmap;
 
-// Clear (unset) any bit within the memory map bit array.
-//
-// This marks the block as being available for use
+// Free lists of the buddy allocator. A bit is set in _freeBlocks[order]
+// when the naturally aligned block of 2^order memory blocks starting at
+// block (bit << order) is free and is not part of a larger free block.
 
-void MemoryMapClearBit(uint32_t bit) 
+static	SummaryBitmap	_freeBlocks[PMM_MAX_ORDER + 1];
+
+// Stack of free single blocks that sits in front of the buddy allocator so
+// that single block allocations are a pop and frees are a push. Blocks on
+// the stack are marked as free in the memory map but are not on the buddy
+// free lists. The stack takes up one block.
+
+#define PMM_FREE_STACK_SIZE		(PMM_BLOCK_SIZE / sizeof(uint32_t))
+
+// When the stack is empty, it is refilled with a buddy block of this order
+
+#define PMM_FREE_STACK_REFILL_ORDER	4
+
+static	uint32_t*	_freeStack = 0;
+
+static	uint32_t	_freeStackCount = 0;
+
+// One record for every block covered by the memory map, indexed by frame
+// number. Free blocks have a zero record.
+
+static	PageFrame*	_pageFrames = 0;
+
+// Number of blocks currently in use by each owner
+
+static	uint32_t	_ownerBlockCount[PMM_OWNER_COUNT];
+
+// Pool of blocks that have already been filled with zeros, refilled while
+// the system is idle. Like the free stack, blocks in the pool are marked as
+// free in the memory map but are not on the buddy free lists. Blocks can
+// only be zeroed if they are mapped somewhere, so the pool takes them from
+// low memory, which is identity mapped, until the VMM has mapped all of
+// memory with PMM_SetDirectMap.
+
+#define PMM_ZEROED_POOL_SIZE	16
+
+static	uint32_t	_zeroedPool[PMM_ZEROED_POOL_SIZE];
+
+static	uint32_t	_zeroedPoolCount = 0;
+
+static	PMM_Zone	_zeroedPoolZone = PMM_ZONE_LOW;
+
+// Virtual address that physical address 0 is mapped at
+
+static	uint32_t	_directMapBase = 0;
+
+// Routine used to fill a block with zeros, chosen when the PMM is initialised
+
+static	void		(*_zeroBlock)(void* p) = 0;
+
+// Allocation trace. When tracing is enabled, every allocation and free made
+// through the public allocation routines is recorded in a ring buffer along
+// with the address it was called from. When tracing is disabled, the cost
+// is one test of _traceEnabled.
+
+#define PMM_TRACE_SIZE			256
+
+static	bool			_traceEnabled = false;
+
+static	PMM_TraceEntry	_trace[PMM_TRACE_SIZE];
+
+// Total number of entries ever recorded. The newest entry is at
+// (_traceCount - 1) % PMM_TRACE_SIZE.
+
+static	uint32_t		_traceCount = 0;
+
+// Physical address ranges that the zones are built from. Buddy blocks
+// never straddle a range boundary, so every free block lies in one range.
+
+typedef struct _ZoneRange
 {
-	_memoryMap[bit / 32] &= ~(1 << (bit % 32));
-}
+	uint32_t	StartFrame;
+	uint32_t	EndFrame;
+	bool		HighestFirst;
+} ZoneRange;
 
-// Test if any bit is set within the memory map bit array
+#define PMM_1MB_FRAME			(0x100000 / PMM_BLOCK_SIZE)
+#define PMM_16MB_FRAME			(0x1000000 / PMM_BLOCK_SIZE)
+
+// ISA DMA transfers cannot cross a 64K boundary. A naturally aligned
+// buddy block of up to this order never does.
+
+#define PMM_DMA_MAX_ORDER		4
+
+// The ranges searched for each zone, in order of preference, terminated by
+// an empty range. Low memory is searched last, so that it is only used up
+// when nothing else is left, and ordinary allocations come from the top
+// of memory down.
+
+static	ZoneRange	_zoneRanges[][4] =
+{
+	// PMM_ZONE_LOW
+	{ { 0, PMM_1MB_FRAME, false }, { 0, 0, false } },
+	// PMM_ZONE_DMA
+	{ { PMM_1MB_FRAME, PMM_16MB_FRAME, false }, { 0, PMM_1MB_FRAME, false }, { 0, 0, false } },
+	// PMM_ZONE_NORMAL
+	{ { PMM_16MB_FRAME, 0xFFFFFFFF, true }, { PMM_1MB_FRAME, PMM_16MB_FRAME, true }, { 0, PMM_1MB_FRAME, true }, { 0, 0, false } }
+};
+
+// Maximum number of entries read from the BIOS memory map
+
+#define PMM_MAX_MEMORY_REGIONS	32
+
+// The PMM can only manage the first 4GB of physical memory
+
+#define PMM_4GB_FRAME			0x100000
+
+// The PMM's own data is set up before the VMM takes over, while the boot
+// loader only maps the first 4MB, and it is reached through the identity
+// mapping of the first 4MB that the VMM keeps. All of it has to fit below
+// this address.
+
+#define PMM_IDENTITY_MAP_END	0x400000
+
+// The BIOS memory map after it has been sorted, split into ranges that do
+// not overlap and truncated at 4GB. Available ranges are rounded inwards
+// to whole blocks and all other ranges are rounded outwards.
+
+typedef struct _PhysicalRegion
+{
+	uint32_t	StartFrame;
+	uint32_t	EndFrame;
+	uint32_t	Type;
+} PhysicalRegion;
+
+static	PhysicalRegion*	_physicalRegions = 0;
+
+static	uint32_t		_physicalRegionCount = 0;
+
+// Arena for data that is only needed while the kernel initialises. It sits
+// right after the rest of the PMM's data, is handed out by bumping a
+// pointer and goes back to the PMM in one go once initialisation is over.
+
+#define PMM_BOOT_ARENA_SIZE		(16 * PMM_BLOCK_SIZE)
+
+static	uint32_t		_bootArenaStart = 0;
+
+static	uint32_t		_bootArenaNext = 0;
+
+static	uint32_t		_bootArenaEnd = 0;
+
+// The PIT is programmed to tick 100 times a second by HAL_Initialise
+
+#define PMM_TICKS_PER_SECOND	100
+
+// Number of ticks that each allocation benchmark runs for
+
+#define PMM_BENCHMARK_TICKS		10
+
+// Private functions
+
+// Return the number of set bits in value.
 //
-// This tests to see if a block is in use
+// The target processors do not have popcnt, so the bits are added up in
+// parallel within the dword.
 
-bool MemoryMapTestBit(uint32_t bit) 
+static inline uint32_t PopulationCount(uint32_t value)
 {
-	return _memoryMap[bit / 32] &  (1 << (bit % 32));
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	value = (value + (value >> 4)) & 0x0F0F0F0F;
+	return (value * 0x01010101) >> 24;
 }
 
-// Find first free block in the bit array and returns its index
+// Lay out a summary bitmap of 'bits' bits at 'address', clearing every bit.
+//
+// Returns the number of bytes used.
 
-uint32_t MemoryMapFindFirstFree() 
+uint32_t SummaryBitmapInitialise(SummaryBitmap* bitmap, uint32_t address, uint32_t bits)
 {
-	for (uint32_t i = 0; i < _memoryMapSize; i++)
+	uint32_t* level = (uint32_t*)address;
+	uint32_t words = (bits + 31) / 32;
+	bitmap->LevelCount = 0;
+	for (;;)
 	{
-		// If the entire dword is marked as in-use, we do not
-		// need to check every bit
-		if (_memoryMap[i] != 0xffffffff)
+		bitmap->Levels[bitmap->LevelCount] = level;
+		bitmap->Words[bitmap->LevelCount++] = words;
+		memset(level, 0, words * 4);
+		level += words;
+		if (words == 1 || bitmap->LevelCount > PMM_MAX_SUMMARY_LEVELS)
 		{
-			for (int j = 0; j < 32; j++) 
-			{				
-				// Test each bit in the dword
-				uint32_t bit = 1 << j;
-				if (!(_memoryMap[i] & bit))
-				{
-					// Return offset of bit in bitmap
-					return i * 32 + j;
-				}
-			}
+			break;
 		}
+		words = (words + 31) / 32;
 	}
-	// Indicate that no free blocks have been found
-	return 0xFFFFFFFF;
+	return (uint32_t)level - address;
 }
 
-// Finds first free "size" number of blocks and returns its index
+// Set a bit, carrying on up the summary levels while dwords become non-zero
 
-uint32_t MemoryMapFindFirstFreeSize(size_t size) 
+void SummaryBitmapSet(SummaryBitmap* bitmap, uint32_t bit)
 {
-	if (size == 0)
-	{
-		return 0xFFFFFFFF;
-	}
-	uint32_t startingBit = MemoryMapFindFirstFree();
-	if (size == 1 || startingBit == 0xFFFFFFFF)
-	{
-		return startingBit;
-	}
-	while (startingBit + size <= _maximumBlockCount)
+	for (uint32_t level = 0; level < bitmap->LevelCount; level++)
 	{
-		// Search for first free bit
-		while (MemoryMapTestBit(startingBit))
-		{
-			startingBit++;
-		}
-		// Now look at the following bits to see if there are enough free contiguous blocks
-		uint32_t freeBlocks = 0;
-		while (freeBlocks < size && !MemoryMapTestBit(startingBit + freeBlocks))
+		uint32_t* word = &bitmap->Levels[level][bit / 32];
+		bool wasEmpty = (*word == 0);
+		*word |= (1 << (bit % 32));
+		if (!wasEmpty)
 		{
-			freeBlocks++;
+			return;
 		}
-		if (freeBlocks == size)
+		bit /= 32;
+	}
+}
+
+// Clear a bit, carrying on up the summary levels while dwords become zero
+
+void SummaryBitmapClear(SummaryBitmap* bitmap, uint32_t bit)
+{
+	for (uint32_t level = 0; level < bitmap->LevelCount; level++)
+	{
+		uint32_t* word = &bitmap->Levels[level][bit / 32];
+		*word &= ~(1 << (bit % 32));
+		if (*word != 0)
 		{
-			return startingBit;
+			return;
 		}
-		// Adjust startingBit to point to the next non-free block
-		startingBit = startingBit + freeBlocks;
+		bit /= 32;
 	}
-	return 0xFFFFFFFF;
 }
 
-// Initialise the physical memory manager
+// Test if a bit is set
+
+bool SummaryBitmapTest(SummaryBitmap* bitmap, uint32_t bit)
+{
+	return (bitmap->Levels[0][bit / 32] & (1 << (bit % 32))) != 0;
+}
+
+// Find the lowest set bit at or after 'bit'.
 //
-// On entry: memSize = Amount of memory
-//			 bitmap  = Address of the area of memory we will use for our bitmap
+// Rather than scanning the bitmap, we climb the summary levels until we
+// reach a dword with a set bit after our position, then walk back down,
+// picking the first non-zero dword at each level. The cost depends on the
+// number of levels, not on how many bits are clear.
 
-uint32_t PMM_Initialise(BootInfo * bootInfo, uint32_t bitmap) 
+uint32_t SummaryBitmapFindNext(SummaryBitmap* bitmap, uint32_t bit)
 {
-	MemoryRegion *	region = bootInfo->MemoryRegions;
-	uint32_t totalAddressableMemory;
-	uint32_t amountOfAvailableMemory = 0;
-	int i = 0;
-	while (i == 0 || region[i].StartOfRegionLow != 0)
+	uint32_t level = 0;
+	for (;;)
 	{
-		if (region[i].Type == MEMORY_REGION_AVAILABLE)
+		if (level == bitmap->LevelCount || bit / 32 >= bitmap->Words[level])
 		{
-			amountOfAvailableMemory += region[i].SizeOfRegionLow;
-			totalAddressableMemory = region[i].StartOfRegionLow + region[i].SizeOfRegionLow;
+			return 0xFFFFFFFF;
 		}
-		i++;
+		uint32_t word = bitmap->Levels[level][bit / 32] & (0xFFFFFFFF << (bit % 32));
+		if (word != 0)
+		{
+			bit = (bit & ~31) + BitScanForward(word);
+			break;
+		}
+		// Nothing left in this dword, so look from the next one on
+		bit = bit / 32 + 1;
+		level++;
 	}
-	_physicalMemorySize	= amountOfAvailableMemory  / 1024;
-	if (bitmap % PMM_BLOCK_SIZE != 0)
+	while (level > 0)
 	{
-		bitmap = (bitmap / PMM_BLOCK_SIZE + 1) * PMM_BLOCK_SIZE;
-	}	
-	_memoryMap = (uint32_t*)bitmap;
-	_maximumBlockCount = amountOfAvailableMemory / PMM_BLOCK_SIZE;
-	_usedBlocks	= _maximumBlockCount;
+		level--;
+		bit = bit * 32 + BitScanForward(bitmap->Levels[level][bit]);
+	}
+	return bit;
+}
 
-	uint32_t sizeOfMemoryMap = totalAddressableMemory / PMM_BLOCK_SIZE / PMM_BLOCKS_PER_BYTE;
-	if (sizeOfMemoryMap % 4 != 0)
+// Find the highest set bit before 'bit'.
+//
+// This is the mirror image of SummaryBitmapFindNext.
+
+uint32_t SummaryBitmapFindPrevious(SummaryBitmap* bitmap, uint32_t bit)
+{
+	uint32_t level = 0;
+	if (bit == 0)
 	{
-		sizeOfMemoryMap = (sizeOfMemoryMap / 4 + 1) * 4;
-	}	
-	_memoryMapSize = sizeOfMemoryMap / 4;
-	// By default, all of memory is in use
-	memset(_memoryMap, 0xff, sizeOfMemoryMap );
-	i = 0;
-	while (i == 0 || region[i].StartOfRegionLow != 0)
+		return 0xFFFFFFFF;
+	}
+	bit--;
+	for (;;)
 	{
-		if (region[i].Type == MEMORY_REGION_AVAILABLE)
+		if (level == bitmap->LevelCount)
+		{
+			return 0xFFFFFFFF;
+		}
+		if (bit / 32 >= bitmap->Words[level])
+		{
+			bit = bitmap->Words[level] * 32 - 1;
+		}
+		uint32_t word = bitmap->Levels[level][bit / 32] & (0xFFFFFFFF >> (31 - bit % 32));
+		if (word != 0)
 		{
-			PMM_MarkRegionAsAvailable(region[i].StartOfRegionLow, region[i].SizeOfRegionLow);
-			
+			bit = (bit & ~31) + BitScanReverse(word);
+			break;
 		}
-		i++;
+		// Nothing left in this dword, so look from the previous one back
+		if (bit < 32)
+		{
+			return 0xFFFFFFFF;
+		}
+		bit = bit / 32 - 1;
+		level++;
 	}
-	return sizeOfMemoryMap;
+	while (level > 0)
+	{
+		level--;
+		bit = bit * 32 + BitScanReverse(bitmap->Levels[level][bit]);
+	}
+	return bit;
 }
 
-// Mark an area of physical memory as being available for use
+// Set any bit within the memory map bit array
+//
+// This marks the block as being in use
 
-void PMM_MarkRegionAsAvailable(uint32_t base, size_t size) 
+void MemoryMapSetBit(uint32_t bit) 
 {
-	uint32_t align = base / PMM_BLOCK_SIZE;
-	uint32_t offsetInBlock = base % PMM_BLOCK_SIZE;
-	uint32_t adjustedSize = offsetInBlock == 0 ? size : (PMM_BLOCK_SIZE - offsetInBlock) + size;
-	int blockCount = adjustedSize / PMM_BLOCK_SIZE;
-	if (adjustedSize % PMM_BLOCK_SIZE != 0)
-	{
-		blockCount++;
-	}
-	for (int blocks = blockCount; blocks > 0; blocks--) 
-	{
-		MemoryMapClearBit(align++);
-		_usedBlocks--;
-	}
+	_memoryMap[bit / 32] |= (1 << (bit % 32));
 }
 
-// Mark a region of physical memory as being unavailable for use
+// Clear (unset) any bit within the memory map bit array.
+//
+// This marks the block as being available for use
 
-void PMM_MarkRegionAsUnavailable(uint32_t base, size_t size) 
+void MemoryMapClearBit(uint32_t bit) 
 {
-	uint32_t align = base / PMM_BLOCK_SIZE;
-	uint32_t offsetInBlock = base % PMM_BLOCK_SIZE;
-	uint32_t adjustedSize = offsetInBlock == 0 ? size : (PMM_BLOCK_SIZE - offsetInBlock) + size;
-	int blockCount = adjustedSize / PMM_BLOCK_SIZE;
-	if (adjustedSize % PMM_BLOCK_SIZE != 0)
-	{
-		blockCount++;
-	}
-	for (int blocks = blockCount; blocks > 0; blocks--) 
-	{
-		MemoryMapSetBit(align++);
-		_usedBlocks++;
-	}
+	_memoryMap[bit / 32] &= ~(1 << (bit % 32));
 }
 
-// Allocate a single memory block
+// Test if any bit is set within the memory map bit array
+//
+// This tests to see if a block is in use
 
-void* PMM_AllocateBlock() 
+bool MemoryMapTestBit(uint32_t bit) 
+{
+	return (_memoryMap[bit / 32] & (1 << (bit % 32))) != 0;
+}
+
+// Return the bits of memory map dword 'word' that lie within [start, end)
+
+static inline uint32_t MemoryMapRangeMask(uint32_t word, uint32_t start, uint32_t end)
 {
-	if (PMM_GetFreeBlockCount() <= 0)
+	uint32_t mask = 0xFFFFFFFF;
+	if (start > word * 32)
 	{
-		// We are out of memory
-		return 0;	
+		mask &= 0xFFFFFFFF << (start % 32);
 	}
-	uint32_t frame = MemoryMapFindFirstFree();
-	if (frame == 0xFFFFFFFF)
+	if (end < word * 32 + 32)
 	{
-		// Unable to allocate a block of memory
-		return 0;	
+		mask &= ~(0xFFFFFFFF << (end % 32));
 	}
-	// Set the block as being used
-	MemoryMapSetBit(frame);
-	// Convert to a physical address
-	uint32_t addr = frame * PMM_BLOCK_SIZE;
-	_usedBlocks++;
-	return (void*)addr;
+	return mask;
 }
 
-// Free a single memory block
+// Set the bits [start, end) of the memory map, marking the blocks as being
+// in use.
+//
+// The partial dwords at either end are masked and the whole dwords between
+// them are filled with memset. Returns the number of blocks that were not
+// already in use.
 
-void PMM_FreeBlock(void* p) 
+uint32_t MemoryMapSetRange(uint32_t start, uint32_t end)
 {
-	uint32_t addr = (uint32_t)p;
-	uint32_t frame = addr / PMM_BLOCK_SIZE;
-
-	MemoryMapClearBit(frame);
-	_usedBlocks--;
+	if (start >= end)
+	{
+		return 0;
+	}
+	uint32_t first = start / 32;
+	uint32_t last = (end - 1) / 32;
+	uint32_t changed = 0;
+	for (uint32_t word = first + 1; word < last; word++)
+	{
+		changed += 32 - PopulationCount(_memoryMap[word]);
+	}
+	if (last > first + 1)
+	{
+		memset(&_memoryMap[first + 1], 0xff, (last - first - 1) * 4);
+	}
+	uint32_t mask = MemoryMapRangeMask(first, start, end);
+	changed += PopulationCount(~_memoryMap[first] & mask);
+	_memoryMap[first] |= mask;
+	if (last != first)
+	{
+		mask = MemoryMapRangeMask(last, start, end);
+		changed += PopulationCount(~_memoryMap[last] & mask);
+		_memoryMap[last] |= mask;
+	}
+	return changed;
 }
 
-// Allocate size blocks of memory
+// Clear the bits [start, end) of the memory map, marking the blocks as
+// being available for use.
+//
+// Returns the number of blocks that were previously in use.
 
-void * PMM_AllocateBlocks(size_t size) 
+uint32_t MemoryMapClearRange(uint32_t start, uint32_t end)
 {
-	if (PMM_GetFreeBlockCount() <= size)
+	if (start >= end)
 	{
-		// Not enough free space
-		return 0;	
+		return 0;
 	}
-	uint32_t frame = MemoryMapFindFirstFreeSize(size);
-	if (frame == 0xFFFFFFFF)
+	uint32_t first = start / 32;
+	uint32_t last = (end - 1) / 32;
+	uint32_t changed = 0;
+	for (uint32_t word = first + 1; word < last; word++)
 	{
-		// Not enough space
-		return 0;	
+		changed += PopulationCount(_memoryMap[word]);
 	}
-	for (uint32_t i=0; i < size; i++)
+	if (last > first + 1)
 	{
-		// Mark the memory as used
-		MemoryMapSetBit(frame+i);
+		memset(&_memoryMap[first + 1], 0, (last - first - 1) * 4);
 	}
-	uint32_t addr = frame * PMM_BLOCK_SIZE;
-	_usedBlocks += size;
-	return (void*)addr;
+	uint32_t mask = MemoryMapRangeMask(first, start, end);
+	changed += PopulationCount(_memoryMap[first] & mask);
+	_memoryMap[first] &= ~mask;
+	if (last != first)
+	{
+		mask = MemoryMapRangeMask(last, start, end);
+		changed += PopulationCount(_memoryMap[last] & mask);
+		_memoryMap[last] &= ~mask;
+	}
+	return changed;
 }
 
-// Free size blocks
+// Find the first block in [start, end) that is in use (or, if 'used' is
+// false, that is free), a dword at a time. Returns end if there is none.
 
-void PMM_FreeBlocks(void* p, size_t size) 
+uint32_t MemoryMapFindNext(uint32_t start, uint32_t end, bool used)
 {
-	uint32_t addr = (uint32_t)p;
-	uint32_t frame = addr / PMM_BLOCK_SIZE;
-
-	for (uint32_t i = 0; i < size; i++)
+	uint32_t bit = start;
+	while (bit < end)
 	{
-		// Mark the memory as freed
-		MemoryMapClearBit(frame+i);
+		uint32_t word = used ? _memoryMap[bit / 32] : ~_memoryMap[bit / 32];
+		word &= 0xFFFFFFFF << (bit % 32);
+		if (word != 0)
+		{
+			bit = (bit & ~31) + BitScanForward(word);
+			return bit < end ? bit : end;
+		}
+		bit = (bit & ~31) + 32;
 	}
-	_usedBlocks -= size;
+	return end;
 }
 
-// Get the amount of physical memory
+// Find the last block in [start, end) that is in use (or, if 'used' is
+// false, that is free), a dword at a time. Returns one past that block, or
+// start if there is none.
 
-size_t PMM_GetAvailableMemorySize() 
+uint32_t MemoryMapFindPrevious(uint32_t start, uint32_t end, bool used)
 {
-	return _physicalMemorySize;
+	uint32_t bit = end;
+	while (bit > start)
+	{
+		uint32_t last = bit - 1;
+		uint32_t word = used ? _memoryMap[last / 32] : ~_memoryMap[last / 32];
+		word &= 0xFFFFFFFF >> (31 - last % 32);
+		if (word != 0)
+		{
+			bit = (last & ~31) + BitScanReverse(word) + 1;
+			return bit > start ? bit : start;
+		}
+		bit = last & ~31;
+	}
+	return start;
 }
 
-// Get the total number of blocks
+// Return the order of the free buddy block that contains 'frame', or -1 if
+// the frame is not free
 
-uint32_t PMM_GetAvailableBlockCount() 
+int BuddyFindContainingBlock(uint32_t frame)
 {
-	return _maximumBlockCount;
+	for (int order = 0; order <= PMM_MAX_ORDER; order++)
+	{
+		if (SummaryBitmapTest(&_freeBlocks[order], frame >> order))
+		{
+			return order;
+		}
+	}
+	return -1;
 }
 
-uint32_t PMM_GetUsedBlockCount() 
-{
-	return _usedBlocks;
-}
+// Test if a block of 2^order frames starting at 'frame' would straddle
+// the boundary between two zone ranges
 
-uint32_t PMM_GetFreeBlockCount() 
+bool BuddyCrossesZoneBoundary(uint32_t frame, uint32_t order)
 {
-	return _maximumBlockCount - _usedBlocks;
+	return frame < PMM_1MB_FRAME && frame + (1 << order) > PMM_1MB_FRAME;
 }
 
-uint32_t PMM_GetBlockSize() 
+// Put a block of 2^order frames starting at 'frame' on the free lists,
+// merging it with its buddy for as long as the buddy is also free
+
+void BuddyInsert(uint32_t frame, uint32_t order)
 {
-	return PMM_BLOCK_SIZE;
+	while (order < PMM_MAX_ORDER)
+	{
+		uint32_t buddy = (frame >> order) ^ 1;
+		if (BuddyCrossesZoneBoundary(frame & ~(1 << order), order + 1) ||
+			!SummaryBitmapTest(&_freeBlocks[order], buddy))
+		{
+			break;
+		}
+		SummaryBitmapClear(&_freeBlocks[order], buddy);
+		frame &= ~(1 << order);
+		order++;
+	}
+	SummaryBitmapSet(&_freeBlocks[order], frame >> order);
 }
 
-uint32_t PMM_GetMemoryMap()
+// Put 'count' frames starting at 'frame' on the free lists, splitting the
+// range into the largest naturally aligned blocks that fit
+
+void BuddyInsertRange(uint32_t frame, uint32_t count)
 {
-	return (uint32_t)_memoryMap;
+	while (count > 0)
+	{
+		uint32_t order = frame == 0 ? PMM_MAX_ORDER : BitScanForward(frame);
+		if (order > PMM_MAX_ORDER)
+		{
+			order = PMM_MAX_ORDER;
+		}
+		while ((1u << order) > count || BuddyCrossesZoneBoundary(frame, order))
+		{
+			order--;
+		}
+		BuddyInsert(frame, order);
+		frame += 1 << order;
+		count -= 1 << order;
+	}
 }
 
+// Take every free frame in the range [start, end) off the free lists.
+// The free stack must be empty.
+//
+// Any free block that straddles the edge of the range is split and the
+// part outside the range is put back.
+
+void BuddyRemoveRange(uint32_t start, uint32_t end)
+{
+	uint32_t frame = start;
+	while (frame < end)
+	{
+		int order = BuddyFindContainingBlock(frame);
+		if (order < 0)
+		{
+			// Skip straight to the next block that the memory map says is free
+			frame = MemoryMapFindNext(frame + 1, end, false);
+			continue;
+		}
+		uint32_t blockStart = frame & ~((1 << order) - 1);
+		uint32_t blockEnd = blockStart + (1 << order);
+		SummaryBitmapClear(&_freeBlocks[order], frame >> order);
+		if (blockStart < start)
+		{
+			BuddyInsertRange(blockStart, start - blockStart);
+		}
+		if (blockEnd > end)
+		{
+			BuddyInsertRange(end, blockEnd - end);
+		}
+		frame = blockEnd;
+	}
+}
+
+// Return the smallest order whose blocks hold at least 'size' frames
+
+uint32_t BuddyOrderForSize(size_t size)
+{
+	uint32_t order = 0;
+	while ((1u << order) < size)
+	{
+		order++;
+	}
+	return order;
+}
+
+// Take a naturally aligned block of 2^order frames that lies within a
+// zone range off the free lists and return its first frame, or 0xFFFFFFFF
+// if there is none.
+//
+// We take the first (or last) free block in the range of the smallest
+// order that is large enough, then split it in half repeatedly, putting
+// the halves we do not want back on the free lists, until it is the
+// requested size.
+
+uint32_t BuddyTakeInRange(uint32_t order, ZoneRange* range)
+{
+	for (uint32_t found = order; found <= PMM_MAX_ORDER; found++)
+	{
+		uint32_t index;
+		if (range->HighestFirst)
+		{
+			index = SummaryBitmapFindPrevious(&_freeBlocks[found], range->EndFrame >> found);
+			if (index == 0xFFFFFFFF || (index << found) < range->StartFrame)
+			{
+				continue;
+			}
+		}
+		else
+		{
+			uint32_t first = (range->StartFrame + (1 << found) - 1) >> found;
+			index = SummaryBitmapFindNext(&_freeBlocks[found], first);
+			if (index == 0xFFFFFFFF || ((index + 1) << found) > range->EndFrame)
+			{
+				continue;
+			}
+		}
+		SummaryBitmapClear(&_freeBlocks[found], index);
+		uint32_t frame = index << found;
+		while (found > order)
+		{
+			found--;
+			if (range->HighestFirst)
+			{
+				SummaryBitmapSet(&_freeBlocks[found], frame >> found);
+				frame += 1 << found;
+			}
+			else
+			{
+				SummaryBitmapSet(&_freeBlocks[found], (frame >> found) + 1);
+			}
+		}
+		return frame;
+	}
+	return 0xFFFFFFFF;
+}
+
+// Take a block of 2^order frames from the first range of the zone that
+// has one
+
+uint32_t BuddyTake(uint32_t order, PMM_Zone zone)
+{
+	for (ZoneRange* range = _zoneRanges[zone]; range->EndFrame != 0; range++)
+	{
+		uint32_t frame = BuddyTakeInRange(order, range);
+		if (frame != 0xFFFFFFFF)
+		{
+			return frame;
+		}
+	}
+	return 0xFFFFFFFF;
+}
+
+// Give every block on the free stack back to the buddy allocator
+
+void FreeStackDrain()
+{
+	while (_freeStackCount > 0)
+	{
+		BuddyInsert(_freeStack[--_freeStackCount], 0);
+	}
+}
+
+// Give every block in the zeroed pool back to the buddy allocator
+
+void ZeroedPoolDrain()
+{
+	while (_zeroedPoolCount > 0)
+	{
+		BuddyInsert(_zeroedPool[--_zeroedPoolCount], 0);
+	}
+}
+
+// Give every block held outside the buddy allocator back to it
+
+void ReleaseHeldBlocks()
+{
+	FreeStackDrain();
+	ZeroedPoolDrain();
+}
+
+// Refill the empty free stack from the buddy allocator. Returns false if
+// there are no free blocks left.
+
+bool FreeStackRefill()
+{
+	uint32_t order = PMM_FREE_STACK_REFILL_ORDER;
+	uint32_t frame = BuddyTake(order, PMM_ZONE_NORMAL);
+	if (frame == 0xFFFFFFFF)
+	{
+		// Memory is too fragmented for a whole batch, so take what we can
+		order = 0;
+		frame = BuddyTake(order, PMM_ZONE_NORMAL);
+		if (frame == 0xFFFFFFFF && _zeroedPoolCount > 0)
+		{
+			// The last free blocks may be sitting in the zeroed pool
+			ZeroedPoolDrain();
+			frame = BuddyTake(order, PMM_ZONE_NORMAL);
+		}
+		if (frame == 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	// Push in order so that the highest block is handed out first
+	for (uint32_t i = 0; i < (1u << order); i++)
+	{
+		_freeStack[_freeStackCount++] = frame + i;
+	}
+	return true;
+}
+
+// Record that 'count' blocks starting at 'frame' have been allocated to
+// the kernel.
+
+void PageFramesAllocated(uint32_t frame, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		_pageFrames[frame + i].RefCount = 1;
+		_pageFrames[frame + i].Owner = PMM_OWNER_KERNEL;
+		_pageFrames[frame + i].Flags = 0;
+	}
+	_ownerBlockCount[PMM_OWNER_KERNEL] += count;
+}
+
+// Clear the records of 'count' blocks starting at 'frame' as they are freed
+
+void PageFramesFreed(uint32_t frame, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		PageFrame * pageFrame = &_pageFrames[frame + i];
+		_ownerBlockCount[pageFrame->Owner]--;
+		pageFrame->RefCount = 0;
+		pageFrame->Owner = PMM_OWNER_NONE;
+		pageFrame->Flags = 0;
+	}
+}
+
+// Where BIOS memory map entries overlap, the type that is least usable
+// wins. Types that we do not know about are treated as not available.
+
+uint32_t MemoryRegionPriority(uint32_t type)
+{
+	switch (type)
+	{
+		case MEMORY_REGION_AVAILABLE:
+			return 0;
+
+		case MEMORY_REGION_ACPI_RECLAIM:
+			return 1;
+
+		case MEMORY_REGION_ACPI_NVS:
+			return 2;
+
+		default:
+			return 3;
+	}
+}
+
+// Add a range of the BIOS memory map to _physicalRegions, merging it with
+// the previous range if they are of the same type and touch.
+
+void PhysicalRegionAdd(uint64_t start, uint64_t end, uint32_t type)
+{
+	uint32_t startFrame;
+	uint32_t endFrame;
+	if (type == MEMORY_REGION_AVAILABLE)
+	{
+		startFrame = (uint32_t)((start + PMM_BLOCK_SIZE - 1) >> PMM_BLOCK_SHIFT);
+		endFrame = (uint32_t)(end >> PMM_BLOCK_SHIFT);
+	}
+	else
+	{
+		startFrame = (uint32_t)(start >> PMM_BLOCK_SHIFT);
+		endFrame = (uint32_t)((end + PMM_BLOCK_SIZE - 1) >> PMM_BLOCK_SHIFT);
+	}
+	if (startFrame >= endFrame)
+	{
+		return;
+	}
+	if (_physicalRegionCount > 0)
+	{
+		// Rounding a reserved range outwards can make it overlap the range
+		// before it by a block, which then stays with the earlier range
+		PhysicalRegion * previous = &_physicalRegions[_physicalRegionCount - 1];
+		if (previous->EndFrame > startFrame)
+		{
+			startFrame = previous->EndFrame;
+			if (startFrame >= endFrame)
+			{
+				return;
+			}
+		}
+		if (previous->Type == type && previous->EndFrame == startFrame)
+		{
+			previous->EndFrame = endFrame;
+			return;
+		}
+	}
+	_physicalRegions[_physicalRegionCount].StartFrame = startFrame;
+	_physicalRegions[_physicalRegionCount].EndFrame = endFrame;
+	_physicalRegions[_physicalRegionCount].Type = type;
+	_physicalRegionCount++;
+}
+
+// Build _physicalRegions from the memory map returned by the BIOS.
+//
+// The BIOS is allowed to return entries in any order and to return entries
+// that overlap. The start and end of every entry (truncated to 4GB) are
+// sorted, and each range between two neighbouring points is given the
+// least usable type of the entries that cover it. Ranges that no entry
+// covers are left out.
+
+void PhysicalRegionsBuild(MemoryRegion * region, uint32_t regionCount)
+{
+	uint64_t limit = (uint64_t)PMM_4GB_FRAME * PMM_BLOCK_SIZE;
+	uint64_t points[PMM_MAX_MEMORY_REGIONS * 2];
+	uint64_t starts[PMM_MAX_MEMORY_REGIONS];
+	uint64_t ends[PMM_MAX_MEMORY_REGIONS];
+	uint32_t pointCount = 0;
+	if (regionCount > PMM_MAX_MEMORY_REGIONS)
+	{
+		regionCount = PMM_MAX_MEMORY_REGIONS;
+	}
+	for (uint32_t i = 0; i < regionCount; i++)
+	{
+		uint64_t start = ((uint64_t)region[i].StartOfRegionHigh << 32) | region[i].StartOfRegionLow;
+		uint64_t size = ((uint64_t)region[i].SizeOfRegionHigh << 32) | region[i].SizeOfRegionLow;
+		uint64_t end = start + size;
+		if (end < start || end > limit)
+		{
+			end = limit;
+		}
+		if (start > end)
+		{
+			start = end;
+		}
+		starts[i] = start;
+		ends[i] = end;
+		points[pointCount++] = start;
+		points[pointCount++] = end;
+	}
+	// There are only a few dozen points, so an insertion sort is fine
+	for (uint32_t i = 1; i < pointCount; i++)
+	{
+		uint64_t point = points[i];
+		uint32_t j = i;
+		while (j > 0 && points[j - 1] > point)
+		{
+			points[j] = points[j - 1];
+			j--;
+		}
+		points[j] = point;
+	}
+	_physicalRegionCount = 0;
+	for (uint32_t p = 0; p + 1 < pointCount; p++)
+	{
+		if (points[p] == points[p + 1])
+		{
+			continue;
+		}
+		bool covered = false;
+		uint32_t type = MEMORY_REGION_AVAILABLE;
+		for (uint32_t i = 0; i < regionCount; i++)
+		{
+			if (starts[i] <= points[p] && ends[i] >= points[p + 1])
+			{
+				if (!covered || MemoryRegionPriority(region[i].Type) > MemoryRegionPriority(type))
+				{
+					type = MemoryRegionPriority(region[i].Type) == 3 ? MEMORY_REGION_NOTAVAILABLE : region[i].Type;
+				}
+				covered = true;
+			}
+		}
+		if (covered)
+		{
+			PhysicalRegionAdd(points[p], points[p + 1], type);
+		}
+	}
+}
+
+// Drop every part of _physicalRegions from 'endFrame' on. Returns the number
+// of available blocks that were dropped.
+
+uint32_t PhysicalRegionsTruncate(uint32_t endFrame)
+{
+	uint32_t dropped = 0;
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < _physicalRegionCount; i++)
+	{
+		PhysicalRegion * region = &_physicalRegions[i];
+		if (region->EndFrame > endFrame)
+		{
+			uint32_t start = region->StartFrame > endFrame ? region->StartFrame : endFrame;
+			if (region->Type == MEMORY_REGION_AVAILABLE)
+			{
+				dropped += region->EndFrame - start;
+			}
+			region->EndFrame = start;
+		}
+		if (region->StartFrame < region->EndFrame)
+		{
+			count = i + 1;
+		}
+	}
+	_physicalRegionCount = count;
+	return dropped;
+}
+
+// Return the largest number of blocks that the PMM can manage when its data
+// starts at 'bitmap' and has to end below PMM_IDENTITY_MAP_END.
+//
+// Each block needs a page frame record and, counting the summary levels,
+// well under a byte for its bits in the memory map and the free lists. The
+// free stack, the boot arena and two blocks for rounding are set aside
+// first.
+
+uint32_t MaximumManagedBlocks(uint32_t bitmap)
+{
+	uint32_t fixed = PMM_FREE_STACK_SIZE * sizeof(uint32_t) + PMM_BOOT_ARENA_SIZE + 2 * PMM_BLOCK_SIZE;
+	if (bitmap + fixed >= PMM_IDENTITY_MAP_END)
+	{
+		return 0;
+	}
+	return (PMM_IDENTITY_MAP_END - bitmap - fixed) / (sizeof(PageFrame) + 1);
+}
+
+// Mark the blocks [start, end) as being available for use. Only blocks
+// that are currently marked as in use are changed.
+
+void MarkFramesAsAvailable(uint32_t start, uint32_t end)
+{
+	if (end > _memoryMapSize * 32)
+	{
+		end = _memoryMapSize * 32;
+	}
+	// Give each run of blocks that is currently in use to the buddy
+	// allocator in as few pieces as possible
+	uint32_t runStart = MemoryMapFindNext(start, end, true);
+	while (runStart < end)
+	{
+		uint32_t runEnd = MemoryMapFindNext(runStart, end, false);
+		PageFramesFreed(runStart, runEnd - runStart);
+		BuddyInsertRange(runStart, runEnd - runStart);
+		runStart = MemoryMapFindNext(runEnd, end, true);
+	}
+	_usedBlocks -= MemoryMapClearRange(start, end);
+}
+
+// Fill 'count' dwords starting at p with 'value' using rep stosd
+
+void FillDwords(void* p, uint32_t value, uint32_t count)
+{
+	asm volatile("cld \n\t"
+				 "rep stosl"
+				 : "+D"(p), "+c"(count)
+				 : "a"(value)
+				 : "memory");
+}
+
+// Fill a block with zeros using rep stosd
+
+void ZeroBlockStosd(void* p)
+{
+	FillDwords(p, 0, PMM_BLOCK_SIZE / 4);
+}
+
+// Fill a block with zeros using SSE2 non-temporal stores. These write
+// around the cache, so zeroing a block does not evict data that is still
+// wanted.
+
+void ZeroBlockSSE2(void* p)
+{
+	asm volatile("pxor    %%xmm0, %%xmm0 \n\t"
+				 "1: \n\t"
+				 "movntdq %%xmm0, (%0) \n\t"
+				 "movntdq %%xmm0, 16(%0) \n\t"
+				 "movntdq %%xmm0, 32(%0) \n\t"
+				 "movntdq %%xmm0, 48(%0) \n\t"
+				 "addl    $64, %0 \n\t"
+				 "cmpl    %1, %0 \n\t"
+				 "jne     1b \n\t"
+				 "sfence"
+				 : "+r"(p)
+				 : "r"((uint32_t)p + PMM_BLOCK_SIZE)
+				 : "memory", "cc");
+}
+
+// Initialise the physical memory manager
+//
+// On entry: bootInfo = Boot information that includes the BIOS memory map
+//			 bitmap   = Address of the area of memory we will use for our bitmap
+
+uint32_t PMM_Initialise(BootInfo * bootInfo, uint32_t bitmap) 
+{
+	// HAL_Initialise has already enabled SSE if the processor supports it
+	_zeroBlock = (HAL_GetCPUFeatures() & HAL_CPU_FEATURE_SSE2) ? ZeroBlockSSE2 : ZeroBlockStosd;
+	_zeroedPoolCount = 0;
+
+	// The BIOS memory map is copied, so the memory that it is in can be
+	// reused once we return. The copy is built on the stack and moved into
+	// the boot arena once that has been set up.
+	PhysicalRegion regions[PMM_MAX_MEMORY_REGIONS * 2];
+	_physicalRegions = regions;
+	PhysicalRegionsBuild(bootInfo->MemoryRegions, bootInfo->MemoryRegionCount);
+	if (bitmap % PMM_BLOCK_SIZE != 0)
+	{
+		bitmap = (bitmap / PMM_BLOCK_SIZE + 1) * PMM_BLOCK_SIZE;
+	}	
+	// Memory beyond what the PMM's data has room to describe is left out
+	_unmanagedBlocks = PhysicalRegionsTruncate(MaximumManagedBlocks(bitmap));
+	uint32_t totalAddressableBlocks = 0;
+	uint32_t availableBlocks = 0;
+	for (uint32_t i = 0; i < _physicalRegionCount; i++)
+	{
+		PhysicalRegion * region = &_physicalRegions[i];
+		if (region->Type == MEMORY_REGION_AVAILABLE)
+		{
+			availableBlocks += region->EndFrame - region->StartFrame;
+		}
+		// The memory map has to cover reclaimable memory too, so that it can
+		// be handed over later
+		if ((region->Type == MEMORY_REGION_AVAILABLE || region->Type == MEMORY_REGION_ACPI_RECLAIM) &&
+			region->EndFrame > totalAddressableBlocks)
+		{
+			totalAddressableBlocks = region->EndFrame;
+		}
+	}
+	_physicalMemorySize	= availableBlocks * (PMM_BLOCK_SIZE / 1024);
+	_memoryMap = (uint32_t*)bitmap;
+	_maximumBlockCount = availableBlocks;
+	_usedBlocks	= _maximumBlockCount;
+
+	uint32_t sizeOfMemoryMap = totalAddressableBlocks / PMM_BLOCKS_PER_BYTE;
+	if (sizeOfMemoryMap % 4 != 0)
+	{
+		sizeOfMemoryMap = (sizeOfMemoryMap / 4 + 1) * 4;
+	}	
+	_memoryMapSize = sizeOfMemoryMap / 4;
+	// By default, all of memory is in use
+	memset(_memoryMap, 0xff, sizeOfMemoryMap );
+
+	// The free lists for each order follow the memory map. Since nothing
+	// is free yet, they all start off empty.
+	uint32_t blockCount = _memoryMapSize * 32;
+	for (int order = 0; order <= PMM_MAX_ORDER; order++)
+	{
+		sizeOfMemoryMap += SummaryBitmapInitialise(&_freeBlocks[order],
+												   bitmap + sizeOfMemoryMap,
+												   (blockCount >> order) + 1);
+	}
+	// The free stack follows the free lists. It is filled on first use.
+	_freeStack = (uint32_t*)(bitmap + sizeOfMemoryMap);
+	_freeStackCount = 0;
+	sizeOfMemoryMap += PMM_FREE_STACK_SIZE * sizeof(uint32_t);
+	// The page frame database follows the free stack. Blocks that are not
+	// available are counted as reserved. A record is one dword, so the
+	// whole database is filled with the same dword in one go.
+	_pageFrames = (PageFrame*)(bitmap + sizeOfMemoryMap);
+	PageFrame reserved = { 1, PMM_OWNER_RESERVED, PMM_FRAME_PINNED };
+	uint32_t reservedRecord;
+	memcpy(&reservedRecord, &reserved, sizeof(PageFrame));
+	FillDwords(_pageFrames, reservedRecord, blockCount);
+	memset(_ownerBlockCount, 0, sizeof(_ownerBlockCount));
+	_ownerBlockCount[PMM_OWNER_RESERVED] = blockCount;
+	sizeOfMemoryMap += blockCount * sizeof(PageFrame);
+	// The boot arena follows the page frame database, starting on a block
+	// boundary so that it can be given back as whole blocks
+	_bootArenaStart = (bitmap + sizeOfMemoryMap + PMM_BLOCK_SIZE - 1) & ~(PMM_BLOCK_SIZE - 1);
+	_bootArenaNext = _bootArenaStart;
+	_bootArenaEnd = _bootArenaStart + PMM_BOOT_ARENA_SIZE;
+	sizeOfMemoryMap = _bootArenaEnd - bitmap;
+	_physicalRegions = (PhysicalRegion*)PMM_BootAllocate(_physicalRegionCount * sizeof(PhysicalRegion));
+	memcpy(_physicalRegions, regions, _physicalRegionCount * sizeof(PhysicalRegion));
+	// The regions do not overlap, so every available block is only counted once
+	for (uint32_t i = 0; i < _physicalRegionCount; i++)
+	{
+		if (_physicalRegions[i].Type == MEMORY_REGION_AVAILABLE)
+		{
+			MarkFramesAsAvailable(_physicalRegions[i].StartFrame, _physicalRegions[i].EndFrame);
+		}
+	}
+	return sizeOfMemoryMap;
+}
+
+// Hand over memory that the BIOS marked as ACPI reclaimable
+//
+// Nothing reads the ACPI tables once we have booted, so their memory is
+// added to the memory available for use.
+
+void PMM_ReclaimBootMemory()
+{
+	for (uint32_t i = 0; i < _physicalRegionCount; i++)
+	{
+		PhysicalRegion * region = &_physicalRegions[i];
+		if (region->Type == MEMORY_REGION_ACPI_RECLAIM)
+		{
+			uint32_t count = region->EndFrame - region->StartFrame;
+			_maximumBlockCount += count;
+			_physicalMemorySize += count * (PMM_BLOCK_SIZE / 1024);
+			// The blocks are counted as used until they are marked as available
+			_usedBlocks += count;
+			MarkFramesAsAvailable(region->StartFrame, region->EndFrame);
+			region->Type = MEMORY_REGION_AVAILABLE;
+		}
+	}
+}
+
+// Allocate 'size' bytes from the boot arena, aligned on an 8 byte boundary.
+// Returns 0 if the arena is full or has already been released.
+
+void* PMM_BootAllocate(size_t size)
+{
+	size = (size + 7) & ~7;
+	if (size > _bootArenaEnd - _bootArenaNext)
+	{
+		return 0;
+	}
+	void* p = (void*)_bootArenaNext;
+	_bootArenaNext += size;
+	return p;
+}
+
+// Give the whole boot arena back to be used as ordinary memory. Anything
+// allocated from it must not be used after this.
+
+void PMM_ReleaseBootArena()
+{
+	if (_bootArenaStart == _bootArenaEnd)
+	{
+		return;
+	}
+	// The copy of the BIOS memory map lives in the arena
+	_physicalRegions = 0;
+	_physicalRegionCount = 0;
+	PMM_MarkRegionAsAvailable(_bootArenaStart, _bootArenaEnd - _bootArenaStart);
+	_bootArenaStart = _bootArenaNext = _bootArenaEnd;
+}
+
+// Mark an area of physical memory as being available for use
+//
+// Only blocks that are currently marked as in use are changed, so marking
+// a region that is already partly available is safe.
+
+void PMM_MarkRegionAsAvailable(uint32_t base, size_t size) 
+{
+	uint32_t align = base / PMM_BLOCK_SIZE;
+	uint32_t offsetInBlock = base % PMM_BLOCK_SIZE;
+	uint32_t adjustedSize = offsetInBlock == 0 ? size : (PMM_BLOCK_SIZE - offsetInBlock) + size;
+	uint32_t blockCount = adjustedSize / PMM_BLOCK_SIZE;
+	if (adjustedSize % PMM_BLOCK_SIZE != 0)
+	{
+		blockCount++;
+	}
+	MarkFramesAsAvailable(align, align + blockCount);
+}
+
+// Mark a region of physical memory as being unavailable for use
+//
+// Only blocks that are currently available are changed, so marking a region
+// that is already partly unavailable is safe.
+
+void PMM_MarkRegionAsUnavailable(uint32_t base, size_t size) 
+{
+	uint32_t align = base / PMM_BLOCK_SIZE;
+	uint32_t offsetInBlock = base % PMM_BLOCK_SIZE;
+	uint32_t adjustedSize = offsetInBlock == 0 ? size : (PMM_BLOCK_SIZE - offsetInBlock) + size;
+	uint32_t blockCount = adjustedSize / PMM_BLOCK_SIZE;
+	if (adjustedSize % PMM_BLOCK_SIZE != 0)
+	{
+		blockCount++;
+	}
+	uint32_t end = align + blockCount;
+	if (end > _memoryMapSize * 32)
+	{
+		end = _memoryMapSize * 32;
+	}
+	// Blocks on the free stack and in the zeroed pool are not on the free
+	// lists, so put them back where BuddyRemoveRange can find them
+	ReleaseHeldBlocks();
+	BuddyRemoveRange(align, end);
+	for (uint32_t frame = MemoryMapFindNext(align, end, false); frame < end;
+		 frame = MemoryMapFindNext(frame + 1, end, false))
+	{
+		_pageFrames[frame].RefCount = 1;
+		_pageFrames[frame].Owner = PMM_OWNER_RESERVED;
+		_pageFrames[frame].Flags = PMM_FRAME_PINNED;
+		_ownerBlockCount[PMM_OWNER_RESERVED]++;
+	}
+	_usedBlocks += MemoryMapSetRange(align, end);
+}
+
+// Add an entry to the allocation trace. Failed allocations are not
+// recorded.
+
+void TraceRecord(PMM_TraceType type, void* callSite, void* p, uint32_t blocks)
+{
+	if (p == 0)
+	{
+		return;
+	}
+	PMM_TraceEntry * entry = &_trace[_traceCount % PMM_TRACE_SIZE];
+	entry->CallSite = (uint32_t)callSite;
+	entry->Address = (uint32_t)p;
+	entry->Blocks = blocks;
+	entry->Tick = HAL_GetTickCount();
+	entry->Type = type;
+	_traceCount++;
+}
+
+// Test if 'count' more blocks can be allocated without using blocks that
+// have been committed
+
+static inline bool UncommittedBlocksAvailable(uint32_t count)
+{
+	return _usedBlocks + _committedBlocks + count <= _maximumBlockCount;
+}
+
+// Allocate a naturally aligned block of 2^order memory blocks from a zone
+
+void* AllocateOrderInZone(uint32_t order, PMM_Zone zone)
+{
+	if (order > PMM_MAX_ORDER || !UncommittedBlocksAvailable(1 << order))
+	{
+		return 0;
+	}
+	uint32_t frame = BuddyTake(order, zone);
+	if (frame == 0xFFFFFFFF && (_freeStackCount > 0 || _zeroedPoolCount > 0))
+	{
+		// The blocks held on the free stack and in the zeroed pool may be
+		// what is stopping the buddies from merging, so give them back and
+		// try again
+		ReleaseHeldBlocks();
+		frame = BuddyTake(order, zone);
+	}
+	if (frame == 0xFFFFFFFF)
+	{
+		// Unable to allocate a block of memory
+		return 0;
+	}
+	// Mark the memory as used
+	MemoryMapSetRange(frame, frame + (1 << order));
+	PageFramesAllocated(frame, 1 << order);
+	_usedBlocks += 1 << order;
+	// Convert to a physical address
+	return (void*)(frame * PMM_BLOCK_SIZE);
+}
+
+// Allocate a naturally aligned block of 2^order memory blocks.
+
+void* PMM_AllocateOrder(uint32_t order)
+{
+	void* p = AllocateOrderInZone(order, PMM_ZONE_NORMAL);
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, 1 << order);
+	}
+	return p;
+}
+
+// Free a block of 2^order memory blocks allocated by PMM_AllocateOrder
+
+void PMM_FreeOrder(void* p, uint32_t order)
+{
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_FREE, __builtin_return_address(0), p, 1 << order);
+	}
+	uint32_t frame = (uint32_t)p / PMM_BLOCK_SIZE;
+
+	// Mark the memory as freed
+	MemoryMapClearRange(frame, frame + (1 << order));
+	PageFramesFreed(frame, 1 << order);
+	BuddyInsert(frame, order);
+	_usedBlocks -= 1 << order;
+}
+
+// Allocate a single memory block
+//
+// This pops a block off the free stack, so it takes constant time apart
+// from the occasional refill from the buddy allocator.
+
+void* AllocateSingleBlock() 
+{
+	if (!UncommittedBlocksAvailable(1) || (_freeStackCount == 0 && !FreeStackRefill()))
+	{
+		// We are out of memory
+		return 0;
+	}
+	uint32_t frame = _freeStack[--_freeStackCount];
+	// Set the block as being used
+	MemoryMapSetBit(frame);
+	PageFramesAllocated(frame, 1);
+	_usedBlocks++;
+	// Convert to a physical address
+	return (void*)(frame * PMM_BLOCK_SIZE);
+}
+
+// Free a single memory block
+//
+// The block is pushed onto the free stack. If the stack is full, the older
+// half of it is given back to the buddy allocator first.
+
+void FreeSingleBlock(void* p) 
+{
+	uint32_t addr = (uint32_t)p;
+	uint32_t frame = addr / PMM_BLOCK_SIZE;
+
+	MemoryMapClearBit(frame);
+	PageFramesFreed(frame, 1);
+	_usedBlocks--;
+	if (_freeStackCount == PMM_FREE_STACK_SIZE)
+	{
+		uint32_t half = PMM_FREE_STACK_SIZE / 2;
+		for (uint32_t i = 0; i < half; i++)
+		{
+			BuddyInsert(_freeStack[i], 0);
+		}
+		memcpy(_freeStack, _freeStack + half, half * sizeof(uint32_t));
+		_freeStackCount -= half;
+	}
+	_freeStack[_freeStackCount++] = frame;
+}
+
+// Allocate a run of 'count' free blocks starting at 'start'
+
+void* AllocateRun(uint32_t start, size_t count)
+{
+	BuddyRemoveRange(start, start + count);
+	MemoryMapSetRange(start, start + count);
+	PageFramesAllocated(start, count);
+	_usedBlocks += count;
+	return (void*)(start * PMM_BLOCK_SIZE);
+}
+
+// Allocate 'count' contiguous blocks of memory from a zone by searching the
+// memory map for a run of free blocks. Ranges that hand out their highest
+// blocks first are searched from the top. This is only used for runs larger
+// than the largest buddy block, so it does not need to be quick.
+
+void* AllocateRunInZone(PMM_Zone zone, size_t count)
+{
+	if (!UncommittedBlocksAvailable(count))
+	{
+		return 0;
+	}
+	// Blocks held on the free stack and in the zeroed pool are free in the
+	// memory map but are not on the free lists, so give them back first
+	ReleaseHeldBlocks();
+	uint32_t mapEnd = _memoryMapSize * 32;
+	for (ZoneRange* range = _zoneRanges[zone]; range->EndFrame != 0; range++)
+	{
+		uint32_t end = range->EndFrame < mapEnd ? range->EndFrame : mapEnd;
+		uint32_t start = range->StartFrame;
+		if (start >= end)
+		{
+			continue;
+		}
+		if (range->HighestFirst)
+		{
+			// Move the end of the run down past any blocks in use
+			end = MemoryMapFindPrevious(start, end, false);
+			while (end - start >= count)
+			{
+				uint32_t used = MemoryMapFindPrevious(end - count, end, true);
+				if (used == end - count)
+				{
+					return AllocateRun(end - count, count);
+				}
+				end = MemoryMapFindPrevious(start, used, false);
+			}
+			continue;
+		}
+		start = MemoryMapFindNext(start, end, false);
+		while (end - start >= count)
+		{
+			uint32_t used = MemoryMapFindNext(start, start + count, true);
+			if (used == start + count)
+			{
+				return AllocateRun(start, count);
+			}
+			start = MemoryMapFindNext(used, end, false);
+		}
+	}
+	return 0;
+}
+
+// Allocate 'count' contiguous blocks of memory from a zone
+//
+// This allocates the smallest buddy block that is big enough and gives the
+// unused tail straight back. Blocks from the DMA zone are limited to 64K,
+// the most an ISA DMA transfer can handle, so that they never cross a 64K
+// boundary. Runs larger than the largest buddy block are found by
+// searching the memory map.
+
+void* AllocateBlocksInZone(PMM_Zone zone, size_t count)
+{
+	if (count == 0 || zone > PMM_ZONE_NORMAL)
+	{
+		return 0;	
+	}
+	uint32_t order = BuddyOrderForSize(count);
+	if (zone == PMM_ZONE_DMA && order > PMM_DMA_MAX_ORDER)
+	{
+		return 0;
+	}
+	if (zone == PMM_ZONE_NORMAL && count == 1)
+	{
+		return AllocateSingleBlock();
+	}
+	if (order > PMM_MAX_ORDER)
+	{
+		return AllocateRunInZone(zone, count);
+	}
+	void* p = AllocateOrderInZone(order, zone);
+	if (!p)
+	{
+		// Not enough space
+		return 0;	
+	}
+	uint32_t frame = (uint32_t)p / PMM_BLOCK_SIZE;
+	uint32_t unused = (1 << order) - count;
+	MemoryMapClearRange(frame + count, frame + (1 << order));
+	PageFramesFreed(frame + count, unused);
+	BuddyInsertRange(frame + count, unused);
+	_usedBlocks -= unused;
+	return p;
+}
+
+// Allocate a single memory block
+
+void* PMM_AllocateBlock() 
+{
+	void* p = AllocateSingleBlock();
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, 1);
+	}
+	return p;
+}
+
+// Free a single memory block
+
+void PMM_FreeBlock(void* p) 
+{
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_FREE, __builtin_return_address(0), p, 1);
+	}
+	FreeSingleBlock(p);
+}
+
+// Allocate 'count' contiguous blocks of memory from a zone
+
+void* PMM_AllocateBlocksInZone(PMM_Zone zone, size_t count)
+{
+	void* p = AllocateBlocksInZone(zone, count);
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, count);
+	}
+	return p;
+}
+
+// Allocate size blocks of memory
+
+void * PMM_AllocateBlocks(size_t size) 
+{
+	void* p = AllocateBlocksInZone(PMM_ZONE_NORMAL, size);
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, size);
+	}
+	return p;
+}
+
+// Free size blocks
+
+void PMM_FreeBlocks(void* p, size_t size) 
+{
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_FREE, __builtin_return_address(0), p, size);
+	}
+	uint32_t addr = (uint32_t)p;
+	uint32_t frame = addr / PMM_BLOCK_SIZE;
+
+	// Mark the memory as freed
+	MemoryMapClearRange(frame, frame + size);
+	PageFramesFreed(frame, size);
+	BuddyInsertRange(frame, size);
+	_usedBlocks -= size;
+}
+
+// Get the amount of physical memory
+
+size_t PMM_GetAvailableMemorySize() 
+{
+	return _physicalMemorySize;
+}
+
+// Get the amount of available physical memory that is not used (in K)
+
+size_t PMM_GetUnmanagedMemorySize()
+{
+	return _unmanagedBlocks * (PMM_BLOCK_SIZE / 1024);
+}
+
+// Get the total number of blocks
+
+uint32_t PMM_GetAvailableBlockCount() 
+{
+	return _maximumBlockCount;
+}
+
+// Get the number of blocks from 0 to the top of the highest region of
+// usable memory
+
+uint32_t PMM_GetAddressableBlockCount()
+{
+	return _memoryMapSize * 32;
+}
+
+uint32_t PMM_GetUsedBlockCount() 
+{
+	return _usedBlocks;
+}
+
+uint32_t PMM_GetFreeBlockCount() 
+{
+	return _maximumBlockCount - _usedBlocks;
+}
+
+uint32_t PMM_GetCommittedBlockCount()
+{
+	return _committedBlocks;
+}
+
+// Promise 'count' blocks to later calls to PMM_AllocateCommittedBlock.
+// Returns false if there are not that many free blocks that have not
+// already been promised.
+
+bool PMM_CommitBlocks(uint32_t count)
+{
+	if (!UncommittedBlocksAvailable(count))
+	{
+		return false;
+	}
+	_committedBlocks += count;
+	return true;
+}
+
+// Take back a promise of 'count' blocks made by PMM_CommitBlocks
+
+void PMM_UncommitBlocks(uint32_t count)
+{
+	_committedBlocks -= count < _committedBlocks ? count : _committedBlocks;
+}
+
+// Allocate one of the blocks promised by PMM_CommitBlocks. This only fails
+// if no blocks have been committed.
+
+void* PMM_AllocateCommittedBlock()
+{
+	if (_committedBlocks == 0)
+	{
+		return 0;
+	}
+	_committedBlocks--;
+	void* p = AllocateSingleBlock();
+	if (!p)
+	{
+		_committedBlocks++;
+	}
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, 1);
+	}
+	return p;
+}
+
+uint32_t PMM_GetBlockSize() 
+{
+	return PMM_BLOCK_SIZE;
+}
+
+uint32_t PMM_GetMemoryMap()
+{
+	return (uint32_t)_memoryMap;
+}
+
+// Allocate a single block that is filled with zeros
+//
+// The block comes from the zeroed pool if there is one ready, so the cost
+// of zeroing is paid while the system is idle. The block is in low memory.
+
+void* PMM_AllocateZeroedBlock()
+{
+	void* p = 0;
+	if (_zeroedPoolCount == 0)
+	{
+		p = AllocateBlocksInZone(_zeroedPoolZone, 1);
+		if (p)
+		{
+			_zeroBlock((void*)(_directMapBase + (uint32_t)p));
+			_pageFrames[(uint32_t)p / PMM_BLOCK_SIZE].Flags |= PMM_FRAME_ZEROED;
+		}
+	}
+	else if (UncommittedBlocksAvailable(1))
+	{
+		uint32_t frame = _zeroedPool[--_zeroedPoolCount];
+		MemoryMapSetBit(frame);
+		PageFramesAllocated(frame, 1);
+		_pageFrames[frame].Flags |= PMM_FRAME_ZEROED;
+		_usedBlocks++;
+		p = (void*)(frame * PMM_BLOCK_SIZE);
+	}
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_ALLOCATE, __builtin_return_address(0), p, 1);
+	}
+	return p;
+}
+
+// Add one zeroed block to the zeroed pool if it is not full.
+//
+// This is meant to be called repeatedly while the system is idle, and only
+// zeroes one block per call so that it never holds things up for long.
+// Returns false once the pool is full or there is no low memory left.
+
+bool PMM_RefillZeroedPool()
+{
+	if (_zeroedPoolCount == PMM_ZEROED_POOL_SIZE)
+	{
+		return false;
+	}
+	uint32_t frame = BuddyTake(0, _zeroedPoolZone);
+	if (frame == 0xFFFFFFFF)
+	{
+		return false;
+	}
+	_zeroBlock((void*)(_directMapBase + frame * PMM_BLOCK_SIZE));
+	_zeroedPool[_zeroedPoolCount++] = frame;
+	return true;
+}
+
+// Called by the VMM once physical memory from 0 up to 'size' bytes is
+// mapped at 'base'. Zeroed blocks can then come from anywhere in that range.
+
+void PMM_SetDirectMap(uint32_t base, uint32_t size)
+{
+	_directMapBase = base;
+	if (size / PMM_BLOCK_SIZE >= _memoryMapSize * 32)
+	{
+		_zeroedPoolZone = PMM_ZONE_NORMAL;
+	}
+	else if (size / PMM_BLOCK_SIZE >= PMM_16MB_FRAME)
+	{
+		// Normal allocations come from the top of memory, which is not all
+		// mapped, so keep to the memory below 16MB
+		_zeroedPoolZone = PMM_ZONE_DMA;
+	}
+}
+
+// Fill a block with zeros, using the fastest method the processor has. The
+// block is addressed by wherever it is currently mapped, not by its frame.
+
+void PMM_ZeroBlock(void* p)
+{
+	_zeroBlock(p);
+}
+
+// Turn allocation tracing on or off. Turning it on starts a new trace.
+
+void PMM_EnableTracing(bool enable)
+{
+	if (enable && !_traceEnabled)
+	{
+		_traceCount = 0;
+	}
+	_traceEnabled = enable;
+}
+
+bool PMM_IsTracing()
+{
+	return _traceEnabled;
+}
+
+// Total up the allocations in the trace that are still live by the address
+// they were made from. An allocation is live if the trace has no later free
+// of the same address and its first block is still in use.
+//
+// Fills in at most maximumCallSites summaries, busiest first, and returns the
+// number filled in.
+
+uint32_t PMM_GetTraceSummary(PMM_TraceSummary * summaries, uint32_t maximumCallSites)
+{
+	uint32_t entryCount = _traceCount < PMM_TRACE_SIZE ? _traceCount : PMM_TRACE_SIZE;
+	uint32_t callSiteCount = 0;
+	for (uint32_t i = 0; i < entryCount; i++)
+	{
+		// Walk from the oldest entry to the newest
+		uint32_t index = (_traceCount - entryCount + i) % PMM_TRACE_SIZE;
+		PMM_TraceEntry * entry = &_trace[index];
+		if (entry->Type != PMM_TRACE_ALLOCATE || _pageFrames[entry->Address / PMM_BLOCK_SIZE].RefCount == 0)
+		{
+			continue;
+		}
+		bool freed = false;
+		for (uint32_t j = i + 1; j < entryCount && !freed; j++)
+		{
+			PMM_TraceEntry * later = &_trace[(_traceCount - entryCount + j) % PMM_TRACE_SIZE];
+			freed = later->Type == PMM_TRACE_FREE && later->Address == entry->Address;
+		}
+		if (freed)
+		{
+			continue;
+		}
+		uint32_t site = 0;
+		while (site < callSiteCount && summaries[site].CallSite != entry->CallSite)
+		{
+			site++;
+		}
+		if (site == callSiteCount)
+		{
+			if (callSiteCount == maximumCallSites)
+			{
+				continue;
+			}
+			summaries[site].CallSite = entry->CallSite;
+			summaries[site].Allocations = 0;
+			summaries[site].Blocks = 0;
+			callSiteCount++;
+		}
+		summaries[site].Allocations++;
+		summaries[site].Blocks += entry->Blocks;
+	}
+	// Sort so that the call sites holding the most memory come first
+	for (uint32_t i = 1; i < callSiteCount; i++)
+	{
+		PMM_TraceSummary summary = summaries[i];
+		uint32_t j = i;
+		while (j > 0 && summaries[j - 1].Blocks < summary.Blocks)
+		{
+			summaries[j] = summaries[j - 1];
+			j--;
+		}
+		summaries[j] = summary;
+	}
+	return callSiteCount;
+}
+
+// Get the number of entries recorded since tracing was turned on
+
+uint32_t PMM_GetTraceCount()
+{
+	return _traceCount;
+}
+
+// Return the page frame database record for the block at physical address
+// p, or 0 if p is outside the memory map
+
+PageFrame* PMM_GetPageFrame(void* p)
+{
+	uint32_t frame = (uint32_t)p / PMM_BLOCK_SIZE;
+	if (frame >= _memoryMapSize * 32)
+	{
+		return 0;
+	}
+	return &_pageFrames[frame];
+}
+
+// Change the owner of 'count' allocated blocks starting at physical
+// address p
+
+void PMM_SetBlockOwner(void* p, size_t count, PMM_FrameOwner owner)
+{
+	uint32_t frame = (uint32_t)p / PMM_BLOCK_SIZE;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		_ownerBlockCount[_pageFrames[frame + i].Owner]--;
+		_pageFrames[frame + i].Owner = owner;
+	}
+	_ownerBlockCount[owner] += count;
+}
+
+// Add a reference to the allocated block at physical address p, so that it
+// can be shared
+
+void PMM_ReferenceBlock(void* p)
+{
+	_pageFrames[(uint32_t)p / PMM_BLOCK_SIZE].RefCount++;
+}
+
+// Drop a reference to the block at physical address p, freeing it when the
+// last reference goes
+
+void PMM_ReleaseBlock(void* p)
+{
+	PageFrame * pageFrame = &_pageFrames[(uint32_t)p / PMM_BLOCK_SIZE];
+	if (pageFrame->RefCount > 1)
+	{
+		pageFrame->RefCount--;
+		return;
+	}
+	if (_traceEnabled)
+	{
+		TraceRecord(PMM_TRACE_FREE, __builtin_return_address(0), p, 1);
+	}
+	FreeSingleBlock(p);
+}
+
+// Get the number of blocks currently in use by an owner
+
+uint32_t PMM_GetOwnerBlockCount(PMM_FrameOwner owner)
+{
+	return _ownerBlockCount[owner];
+}
+
+// Measure how many single blocks can be allocated per second once
+// 'occupancy' percent of the available blocks are in use.
+//
+// The blocks allocated to reach the requested occupancy are found by
+// comparing the memory map against a copy taken beforehand, so the
+// memory map is left as it was found.
+
+uint32_t PMM_MeasureAllocationRate(uint32_t occupancy)
+{
+	uint32_t mapBlocks = (_memoryMapSize * 4 + PMM_BLOCK_SIZE - 1) / PMM_BLOCK_SIZE;
+	// The copy is written through the identity mapping of low memory
+	uint32_t* savedMap = (uint32_t*)PMM_AllocateBlocksInZone(PMM_ZONE_LOW, mapBlocks);
+	if (!savedMap)
+	{
+		return 0;
+	}
+	memcpy(savedMap, _memoryMap, _memoryMapSize * 4);
+
+	// Fill memory up to the requested occupancy
+	uint32_t targetBlocks = _maximumBlockCount / 100 * occupancy;
+	while (_usedBlocks < targetBlocks && PMM_AllocateBlock() != 0);
+
+	// Wait for the start of a tick so that we time whole ticks
+	uint32_t startTick = HAL_GetTickCount();
+	while (HAL_GetTickCount() == startTick);
+	startTick = HAL_GetTickCount();
+
+	uint32_t allocations = 0;
+	while (HAL_GetTickCount() - startTick < PMM_BENCHMARK_TICKS)
+	{
+		void* block = PMM_AllocateBlock();
+		if (!block)
+		{
+			break;
+		}
+		PMM_FreeBlock(block);
+		allocations++;
+	}
+
+	// Give back everything that was allocated to fill memory
+	for (uint32_t i = 0; i < _memoryMapSize; i++)
+	{
+		uint32_t filled = _memoryMap[i] & ~savedMap[i];
+		while (filled != 0)
+		{
+			uint32_t bit = BitScanForward(filled);
+			filled &= filled - 1;
+			PMM_FreeBlock((void*)((i * 32 + bit) * PMM_BLOCK_SIZE));
+		}
+	}
+	PMM_FreeBlocks(savedMap, mapBlocks);
+	return allocations * (PMM_TICKS_PER_SECOND / PMM_BENCHMARK_TICKS);
+}
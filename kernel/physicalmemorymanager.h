@@ -4,16 +4,95 @@
 // The block size is 4096 bytes (4K)
 #define PMM_BLOCK_SIZE			4096
 
+// The largest block the buddy allocator hands out is 2^PMM_MAX_ORDER blocks (4MB)
+#define PMM_MAX_ORDER			10
+
 // Physical Memory Manager
 
 #include <size_t.h>
 #include <stdint.h>
 #include "bootinfo.h"
 
+// Zones that physical memory can be allocated from
+
+typedef enum
+{
+	PMM_ZONE_LOW = 0,		// Below 1MB
+	PMM_ZONE_DMA = 1,		// Below 16MB and not crossing a 64K boundary (at most 64K)
+	PMM_ZONE_NORMAL = 2		// Anywhere, taken from the top of memory down
+} PMM_Zone;
+
+// What a block of physical memory is being used for
+
+typedef enum
+{
+	PMM_OWNER_NONE = 0,			// Free
+	PMM_OWNER_RESERVED = 1,		// Not available, or set aside while booting
+	PMM_OWNER_KERNEL = 2,		// General kernel allocations
+	PMM_OWNER_PAGETABLE = 3,	// Page directories and page tables
+	PMM_OWNER_CACHE = 4,		// Disk block cache
+	PMM_OWNER_DMA = 5,			// DMA buffers
+	PMM_OWNER_COUNT = 6
+} PMM_FrameOwner;
+
+// Flags kept for each block of physical memory
+
+#define PMM_FRAME_PINNED		0x01	// Must never be moved or evicted
+#define PMM_FRAME_DIRTY			0x02	// Contents differ from the backing store
+#define PMM_FRAME_ZEROED		0x04	// Known to be filled with zeros
+
+// The page frame database record kept for every block of physical memory.
+// At four bytes per 4K block, the database takes up 0.1% of memory.
+
+typedef struct _PageFrame
+{
+	uint16_t	RefCount;		// Number of users of the block (0 if free)
+	uint8_t		Owner;			// PMM_FrameOwner
+	uint8_t		Flags;			// PMM_FRAME_xxx flags
+} PageFrame;
+
+// Allocation trace
+
+typedef enum
+{
+	PMM_TRACE_ALLOCATE = 0,
+	PMM_TRACE_FREE = 1
+} PMM_TraceType;
+
+typedef struct _PMM_TraceEntry
+{
+	uint32_t	CallSite;		// Address that the allocation routine returns to
+	uint32_t	Address;		// Physical address allocated or freed
+	uint32_t	Blocks;			// Number of blocks
+	uint32_t	Tick;			// Tick count when the call was made
+	uint32_t	Type;			// PMM_TraceType
+} PMM_TraceEntry;
+
+// Live allocations in the trace, totalled by call site
+
+typedef struct _PMM_TraceSummary
+{
+	uint32_t	CallSite;
+	uint32_t	Allocations;
+	uint32_t	Blocks;
+} PMM_TraceSummary;
+
 // Initialise the physical memory manager
 
 uint32_t PMM_Initialise(BootInfo * bootInfo, uint32_t bitmap);
 
+// Hand over memory that was only needed while booting (ACPI reclaimable memory)
+
+void PMM_ReclaimBootMemory();
+
+// Allocate memory for data that is only needed while the kernel initialises
+
+void* PMM_BootAllocate(size_t size);
+
+// Give the memory used by PMM_BootAllocate back once initialisation is over
+
+void PMM_ReleaseBootArena();
+
 // Mark a region as being available for use
 
 void PMM_MarkRegionAsAvailable(uint32_t base, size_t size); 
@@ -30,22 +109,98 @@ void* PMM_AllocateBlock();
 
 void PMM_FreeBlock(void* p); 
 
+// Allocate a single memory block that is filled with zeros. It is in low
+// memory unless PMM_SetDirectMap has been called.
+
+void* PMM_AllocateZeroedBlock();
+
+// Zero one more block for PMM_AllocateZeroedBlock. Call this when idle.
+
+bool PMM_RefillZeroedPool();
+
+// Tell the PMM that physical memory below 'size' is mapped from 'base'
+
+void PMM_SetDirectMap(uint32_t base, uint32_t size);
+
+// Fill the block mapped at the given address with zeros
+
+void PMM_ZeroBlock(void* p);
+
+// Allocate a naturally aligned block of 2^order memory blocks
+
+void* PMM_AllocateOrder(uint32_t order);
+
+// Free a block of 2^order memory blocks
+
+void PMM_FreeOrder(void* p, uint32_t order);
+
 // Allocate 'size' blocks of memory
 
 void * PMM_AllocateBlocks(size_t size); 
 
+// Allocate 'count' contiguous blocks of memory from a zone
+
+void* PMM_AllocateBlocksInZone(PMM_Zone zone, size_t count);
+
 // Free size blocks
 
 void PMM_FreeBlocks(void* p, size_t size);
 
+// Get the page frame database record for the block at physical address p
+
+PageFrame* PMM_GetPageFrame(void* p);
+
+// Change the owner of 'count' allocated blocks
+
+void PMM_SetBlockOwner(void* p, size_t count, PMM_FrameOwner owner);
+
+// Add a reference to an allocated block
+
+void PMM_ReferenceBlock(void* p);
+
+// Drop a reference to a block, freeing it when the last reference goes
+
+void PMM_ReleaseBlock(void* p);
+
+// Get the number of blocks in use by an owner
+
+uint32_t PMM_GetOwnerBlockCount(PMM_FrameOwner owner);
+
+// Turn allocation tracing on or off
+
+void PMM_EnableTracing(bool enable);
+
+// Is allocation tracing turned on?
+
+bool PMM_IsTracing();
+
+// Get the number of allocations and frees recorded since tracing was turned on
+
+uint32_t PMM_GetTraceCount();
+
+// Total up the live allocations in the trace by call site. Returns the
+// number of call sites filled in.
+
+uint32_t PMM_GetTraceSummary(PMM_TraceSummary * summaries, uint32_t maximumCallSites);
+
 // Get the amount of available physical memory (in K)
 
 size_t PMM_GetAvailableMemorySize(); 
 
+// Get the amount of available physical memory that the PMM has no room to
+// manage and is left unused (in K)
+
+size_t PMM_GetUnmanagedMemorySize();
+
 // Get the total number of blocks of available memory
 
 uint32_t PMM_GetAvailableBlockCount(); 
 
+// Get the number of blocks up to the top of usable memory, including any
+// that are not available
+
+uint32_t PMM_GetAddressableBlockCount();
+
 // Get the number of used blocks of available memory
 
 uint32_t PMM_GetUsedBlockCount(); 
@@ -54,6 +209,26 @@ uint32_t PMM_GetUsedBlockCount();
 
 uint32_t PMM_GetFreeBlockCount(); 
 
+// Get the number of free blocks promised by PMM_CommitBlocks that have not
+// been allocated yet
+
+uint32_t PMM_GetCommittedBlockCount();
+
+// Set aside 'count' free blocks to be allocated later with
+// PMM_AllocateCommittedBlock, which then cannot run out of memory. Other
+// allocations fail rather than use them. Returns false if there are not
+// enough free blocks.
+
+bool PMM_CommitBlocks(uint32_t count);
+
+// Give back 'count' committed blocks that are no longer needed
+
+void PMM_UncommitBlocks(uint32_t count);
+
+// Allocate a block set aside by PMM_CommitBlocks
+
+void* PMM_AllocateCommittedBlock();
+
 // Get the size of a block
 
 uint32_t PMM_GetBlockSize(); 
@@ -62,5 +237,10 @@ uint32_t PMM_GetBlockSize();
 
 uint32_t PMM_GetMemoryMap();
 
+// Measure the number of single block allocations per second with
+// 'occupancy' percent of memory in use
+
+uint32_t PMM_MeasureAllocationRate(uint32_t occupancy);
+
 
 #endif
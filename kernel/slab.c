@@ -0,0 +1,243 @@
+// Slab Allocator
+//
+// A slab is one page of virtual memory backed by one block from the physical
+// memory manager. It starts with a Slab header and a stack of the indices of
+// its free objects, followed by the objects. Allocating an object is a pop
+// from the stack of the first partial slab and freeing it is a push. The
+// free objects themselves are never written to, so they stay in the state
+// the cache's constructor left them in. Since slabs are page aligned, the
+// slab that an object belongs to is found by rounding its address down to
+// a page.
+//
+// Each cache keeps its slabs on three lists: partial, full and empty. A cache
+// holds on to one empty slab so that an object being allocated and freed
+// repeatedly does not create and destroy a slab each time. Any further empty
+// slabs go back to a pool of pages shared by every cache.
+
+#include <string.h>
+#include "slab.h"
+#include "kernelheap.h"
+#include "virtualmemorymanager.h"
+#include "physicalmemorymanager.h"
+#include "kernelspace.h"
+
+// Amount of kernel address space reserved for slabs
+
+#define SLAB_AREA_SIZE			0x08000000
+
+#define SLAB_PAGE_SIZE			4096
+
+// Objects are aligned so that none of them straddles a cache line
+
+#define SLAB_CACHE_LINE			64
+#define SLAB_MIN_ALIGNMENT		8
+
+struct _Slab
+{
+	SlabCache *		Cache;
+	struct _Slab *	Next;
+	struct _Slab *	Previous;
+	uint32_t		InUse;
+	uint16_t		FreeIndices[];		// Stack of free objects, ObjectsPerSlab - InUse deep
+};
+
+// End of the slab area and of the part of it that is mapped
+
+static	uint32_t	_slabLimit = 0;
+static	uint32_t	_slabEnd = 0;
+
+// Pages that have been mapped for slabs but are not being used by any cache
+
+static	Slab *		_freePages = 0;
+
+// Private functions
+
+void SlabListInsert(Slab ** list, Slab * slab)
+{
+	slab->Previous = 0;
+	slab->Next = *list;
+	if (slab->Next)
+	{
+		slab->Next->Previous = slab;
+	}
+	*list = slab;
+}
+
+void SlabListRemove(Slab ** list, Slab * slab)
+{
+	if (slab->Previous)
+	{
+		slab->Previous->Next = slab->Next;
+	}
+	else
+	{
+		*list = slab->Next;
+	}
+	if (slab->Next)
+	{
+		slab->Next->Previous = slab->Previous;
+	}
+}
+
+// Get a page for a new slab, either from the pool of unused pages or by
+// mapping a new block onto the end of the slab area
+
+Slab * SlabGetPage()
+{
+	if (_freePages)
+	{
+		Slab * slab = _freePages;
+		_freePages = slab->Next;
+		return slab;
+	}
+	if (_slabEnd == _slabLimit)
+	{
+		return 0;
+	}
+	void* frame = PMM_AllocateBlock();
+	if (!frame)
+	{
+		return 0;
+	}
+	if (!VMM_MapRange((uint32_t)frame, _slabEnd, 1, I86_PTE_WRITABLE))
+	{
+		PMM_FreeBlock(frame);
+		return 0;
+	}
+	Slab * slab = (Slab*)_slabEnd;
+	_slabEnd += SLAB_PAGE_SIZE;
+	return slab;
+}
+
+// Create a new slab for a cache and put it on the cache's empty list
+
+Slab * SlabCreate(SlabCache * cache)
+{
+	Slab * slab = SlabGetPage();
+	if (!slab)
+	{
+		return 0;
+	}
+	slab->Cache = cache;
+	slab->InUse = 0;
+	uint32_t object = (uint32_t)slab + cache->FirstObjectOffset;
+	for (uint32_t i = 0; i < cache->ObjectsPerSlab; i++)
+	{
+		if (cache->Constructor)
+		{
+			cache->Constructor((void*)object);
+		}
+		// Stack the objects so that they are handed out in address order
+		slab->FreeIndices[i] = cache->ObjectsPerSlab - 1 - i;
+		object += cache->ObjectSize;
+	}
+	SlabListInsert(&cache->EmptySlabs, slab);
+	cache->SlabCount++;
+	return slab;
+}
+
+// Public functions
+
+void Slab_Initialise()
+{
+	_slabEnd = KernelSpace_Reserve(SLAB_AREA_SIZE);
+	_slabLimit = _slabEnd ? _slabEnd + SLAB_AREA_SIZE : 0;
+	_freePages = 0;
+}
+
+SlabCache* Slab_CreateCache(const char* name, size_t size, void (*constructor)(void* object))
+{
+	if (size == 0 || size > SLAB_MAX_OBJECT_SIZE)
+	{
+		return 0;
+	}
+	SlabCache * cache = (SlabCache*)kmalloc(sizeof(SlabCache));
+	if (!cache)
+	{
+		return 0;
+	}
+	// Use the largest power of two alignment, up to a cache line, that does
+	// not more than double the size of small objects
+	uint32_t alignment = SLAB_CACHE_LINE;
+	while (alignment > SLAB_MIN_ALIGNMENT && size <= alignment / 2)
+	{
+		alignment /= 2;
+	}
+	memset(cache, 0, sizeof(SlabCache));
+	cache->Name = name;
+	cache->ObjectSize = (size + alignment - 1) & ~(alignment - 1);
+	// Fit in as many objects as we can along with their entries in the stack
+	// of free objects
+	uint32_t objects = (SLAB_PAGE_SIZE - sizeof(Slab)) / (cache->ObjectSize + sizeof(uint16_t));
+	uint32_t firstObjectOffset;
+	while (true)
+	{
+		firstObjectOffset = (sizeof(Slab) + objects * sizeof(uint16_t) + alignment - 1) & ~(alignment - 1);
+		if (firstObjectOffset + objects * cache->ObjectSize <= SLAB_PAGE_SIZE)
+		{
+			break;
+		}
+		objects--;
+	}
+	cache->ObjectsPerSlab = objects;
+	cache->FirstObjectOffset = firstObjectOffset;
+	cache->Constructor = constructor;
+	return cache;
+}
+
+void* Slab_Allocate(SlabCache* cache)
+{
+	Slab * slab = cache->PartialSlabs;
+	if (!slab)
+	{
+		slab = cache->EmptySlabs;
+		if (!slab && !(slab = SlabCreate(cache)))
+		{
+			return 0;
+		}
+		SlabListRemove(&cache->EmptySlabs, slab);
+		SlabListInsert(&cache->PartialSlabs, slab);
+	}
+	uint32_t index = slab->FreeIndices[cache->ObjectsPerSlab - slab->InUse - 1];
+	slab->InUse++;
+	if (slab->InUse == cache->ObjectsPerSlab)
+	{
+		SlabListRemove(&cache->PartialSlabs, slab);
+		SlabListInsert(&cache->FullSlabs, slab);
+	}
+	cache->ObjectsInUse++;
+	return (void*)((uint32_t)slab + cache->FirstObjectOffset + index * cache->ObjectSize);
+}
+
+void Slab_Free(SlabCache* cache, void* object)
+{
+	if (!object)
+	{
+		return;
+	}
+	Slab * slab = (Slab*)((uint32_t)object & ~(SLAB_PAGE_SIZE - 1));
+	if (slab->InUse == cache->ObjectsPerSlab)
+	{
+		SlabListRemove(&cache->FullSlabs, slab);
+		SlabListInsert(&cache->PartialSlabs, slab);
+	}
+	uint32_t index = ((uint32_t)object - (uint32_t)slab - cache->FirstObjectOffset) / cache->ObjectSize;
+	slab->InUse--;
+	slab->FreeIndices[cache->ObjectsPerSlab - slab->InUse - 1] = index;
+	cache->ObjectsInUse--;
+	if (slab->InUse == 0)
+	{
+		SlabListRemove(&cache->PartialSlabs, slab);
+		if (cache->EmptySlabs)
+		{
+			// The cache already has a spare slab, so let another cache use this page
+			slab->Next = _freePages;
+			_freePages = slab;
+			cache->SlabCount--;
+		}
+		else
+		{
+			SlabListInsert(&cache->EmptySlabs, slab);
+		}
+	}
+}
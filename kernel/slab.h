@@ -0,0 +1,51 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+// Slab Allocator
+//
+// Each cache hands out objects of one fixed size. Objects are carved out of
+// slabs of one page each, so allocating and freeing an object never has to
+// search or merge free space.
+
+#include <size_t.h>
+#include <stdint.h>
+
+// Largest object a cache can hold
+
+#define SLAB_MAX_OBJECT_SIZE	1024
+
+typedef struct _Slab Slab;
+
+typedef struct _SlabCache
+{
+	const char *	Name;
+	uint32_t		ObjectSize;			// Size of each object, including alignment padding
+	uint32_t		ObjectsPerSlab;
+	uint32_t		FirstObjectOffset;	// Offset of the first object from the start of a slab
+	void			(*Constructor)(void* object);
+	Slab *			PartialSlabs;		// Slabs with some objects free
+	Slab *			FullSlabs;			// Slabs with no objects free
+	Slab *			EmptySlabs;			// Slabs with every object free
+	uint32_t		SlabCount;
+	uint32_t		ObjectsInUse;
+} SlabCache;
+
+// Initialise the slab allocator. The kernel heap must already be initialised.
+
+void Slab_Initialise();
+
+// Create a cache of objects of 'size' bytes. If 'constructor' is not 0, it
+// is called for each object when the slab holding it is created, and objects
+// must be in their constructed state when they are freed.
+
+SlabCache* Slab_CreateCache(const char* name, size_t size, void (*constructor)(void* object));
+
+// Allocate an object from a cache. Returns 0 if there is no memory left.
+
+void* Slab_Allocate(SlabCache* cache);
+
+// Return an object to the cache it was allocated from
+
+void Slab_Free(SlabCache* cache, void* object);
+
+#endif
@@ -19,6 +19,63 @@ PageDirectory*		_current_PageDirectory = 0;
 // Current page directory base register
 uint32_t		_current_pdbr = 0;
 
+// Page directory created by VMM_Initialise. Its kernel entries are the ones
+// every address space shares.
+PageDirectory*		_kernelDirectory = 0;
+
+// Everything from here up belongs to the kernel and is the same in every
+// address space
+#define KERNEL_SPACE_START 0xC0000000
+
+// Rough number of TLB entries a processor has for 4K pages. Used to estimate
+// how many translations are kept when CR3 is reloaded.
+#define ESTIMATED_TLB_ENTRIES 64
+
+// Set if kernel pages are marked as global, so that reloading CR3 does not
+// flush them from the TLB
+bool			_globalPages = false;
+
+// Number of pages (or large pages) mapped as global
+uint32_t		_globalPageCount = 0;
+
+// Number of times CR3 has been loaded, and an estimate of how many TLB
+// entries have survived those loads because they were global
+uint32_t		_pageDirectorySwitches = 0;
+uint32_t		_avoidedTLBFlushes = 0;
+
+// When more than this many pages are remapped or unmapped at once, the whole
+// TLB is flushed rather than invalidating the pages one at a time
+#define TLB_FLUSH_THRESHOLD 32
+
+// Number of single pages invalidated and number of times the whole TLB has been flushed
+uint32_t		_singlePageFlushes = 0;
+uint32_t		_fullTLBFlushes = 0;
+
+// Ranges of virtual addresses whose pages are given memory the first time
+// they are touched
+#define MAX_DEMAND_REGIONS 16
+
+typedef struct _DemandRegion
+{
+	virtual_address		Start;
+	virtual_address		End;
+	virtual_address		CommittedEnd;	// Pages below this have memory committed for them
+	uint32_t			Flags;
+} DemandRegion;
+
+DemandRegion	_demandRegions[MAX_DEMAND_REGIONS];
+uint32_t		_demandRegionCount = 0;
+
+// Number of page faults handled by mapping a new page, and the processor
+// cycles spent handling them
+uint32_t		_minorFaults = 0;
+uint32_t		_copyOnWriteFaults = 0;
+uint64_t		_faultCycles = 0;
+uint32_t		_maximumFaultCycles = 0;
+
+// Number of bytes of physical memory mapped from DIRECT_MAP_BASE
+uint32_t		_directMapSize = 0;
+
 PageTableEntry* VMM_LookupPageTableEntry(PageTable * p,virtual_address addr) 
 {
 	if (p)
@@ -44,15 +101,23 @@ bool VMM_SwitchPageDirectory(PageDirectory* dir)
 		return false;
 	}
 	_current_PageDirectory = dir;
+	_current_pdbr = (uint32_t)&dir->entries;
 	HAL_LoadPageDirectoryBaseRegister(_current_pdbr);
+	_pageDirectorySwitches++;
+	if (_globalPages)
+	{
+		// The global entries still in the TLB are kept, up to the size of the TLB
+		_avoidedTLBFlushes += _globalPageCount < ESTIMATED_TLB_ENTRIES ? _globalPageCount : ESTIMATED_TLB_ENTRIES;
+	}
 	return true;
 }
 
 void VMM_FlushTLBEntry(virtual_address addr) 
 {
-	asm volatile("cli \n\t"
-				 "invlpg (%0)\n\t"
-				 "sti" : : "b"(addr) : "memory" );
+	// invlpg cannot be interrupted part way through, so there is no need to
+	// disable interrupts around it
+	asm volatile("invlpg (%0)" : : "r"(addr) : "memory" );
+	_singlePageFlushes++;
 }
 
 PageDirectory* VMM_GetDirectory() 
@@ -60,6 +125,18 @@ PageDirectory* VMM_GetDirectory()
 	return _current_PageDirectory;
 }
 
+PageTableEntry* VMM_GetPageTableEntryAddress(virtual_address addr)
+{
+	// The page tables sit one after the other in the self-mapped window, so
+	// the entry for a page is simply indexed by its page number
+	return &((PageTableEntry*)PAGE_TABLES_VIRTUAL_BASE)[addr >> 12];
+}
+
+PageDirectoryEntry* VMM_GetPageDirectoryEntryAddress(virtual_address addr)
+{
+	return &((PageDirectoryEntry*)PAGE_DIRECTORY_VIRTUAL_BASE)[PAGE_DIRECTORY_INDEX(addr)];
+}
+
 bool VMM_AllocatePage(PageTableEntry* e) 
 {
 	// Allocate a free physical frame
@@ -84,97 +161,757 @@ void VMM_FreePage(PageTableEntry* e)
 	PTE_RemoveAttribute(e, I86_PTE_PRESENT);
 }
 
+// Kernel page tables are shared by every address space, but a table added
+// after an address space was cloned is only in the directory it was added
+// to and in the kernel directory. If the current directory is missing the
+// kernel table for directory entry e, copy it from the kernel directory.
+// Returns true if the entry was copied.
+
+bool SyncKernelPageTable(PageDirectoryEntry* e)
+{
+	uint32_t index = e - (PageDirectoryEntry*)PAGE_DIRECTORY_VIRTUAL_BASE;
+	if (PDE_IsPresent(*e) || index < PAGE_DIRECTORY_INDEX(KERNEL_SPACE_START) ||
+		_current_PageDirectory == _kernelDirectory)
+	{
+		return false;
+	}
+	PageDirectory* kernelDirectory = (PageDirectory*)phys_to_virt((uint32_t)_kernelDirectory);
+	if (!kernelDirectory || !PDE_IsPresent(kernelDirectory->entries[index]))
+	{
+		return false;
+	}
+	*e = kernelDirectory->entries[index];
+	return true;
+}
+
+// Put a page table into the directory entry e, using 'frame' for it. The
+// directory and page tables are reached through the self-map, so it does not
+// matter where the table is in physical memory.
+
+void InstallPageTable(PageDirectoryEntry* e, uint32_t frame)
+{
+	PMM_SetBlockOwner((void*)frame, 1, PMM_OWNER_PAGETABLE);
+	*e = 0;
+	PDE_AddAttribute(e, I86_PDE_PRESENT);
+	PDE_AddAttribute(e, I86_PDE_WRITABLE);
+	PDE_SetFrame(e, frame);
+
+	// New kernel tables go in the kernel directory too, so that other
+	// address spaces can pick them up
+	uint32_t index = e - (PageDirectoryEntry*)PAGE_DIRECTORY_VIRTUAL_BASE;
+	if (index >= PAGE_DIRECTORY_INDEX(KERNEL_SPACE_START) && _current_PageDirectory != _kernelDirectory)
+	{
+		PageDirectory* kernelDirectory = (PageDirectory*)phys_to_virt((uint32_t)_kernelDirectory);
+		if (kernelDirectory)
+		{
+			kernelDirectory->entries[index] = *e;
+		}
+	}
+
+	// The new table is now visible in the self-mapped window. Drop any
+	// translation left over from a table that used to be there, then clear it.
+	virtual_address table = PAGE_TABLES_VIRTUAL_BASE + (e - (PageDirectoryEntry*)PAGE_DIRECTORY_VIRTUAL_BASE) * PAGE_SIZE;
+	VMM_FlushTLBEntry(table);
+	PMM_ZeroBlock((void*)table);
+}
+
+// Put page tables in every directory entry from first to last that does not
+// have one. Returns false if a page table could not be allocated or one of
+// the entries maps a 4MB page.
+
+bool AddPageTables(PageDirectoryEntry* first, PageDirectoryEntry* last)
+{
+	uint32_t missing = 0;
+	for (PageDirectoryEntry* e = first; e <= last; e++)
+	{
+		SyncKernelPageTable(e);
+		if (!PDE_IsPresent(*e))
+		{
+			missing++;
+		}
+		else if (PDE_Is4MB(*e))
+		{
+			return false;
+		}
+	}
+	if (missing == 0)
+	{
+		return true;
+	}
+	// Allocate the missing tables together if there is a run of blocks for
+	// them, otherwise one at a time
+	uint32_t batch = missing > 1 ? (uint32_t)PMM_AllocateBlocks(missing) : 0;
+	uint32_t batchCount = batch ? missing : 0;
+	for (PageDirectoryEntry* e = first; e <= last; e++)
+	{
+		if (PDE_IsPresent(*e))
+		{
+			continue;
+		}
+		uint32_t frame = batch;
+		if (batchCount > 0)
+		{
+			batch += PAGE_SIZE;
+			batchCount--;
+		}
+		else if ((frame = (uint32_t)PMM_AllocateBlock()) == 0)
+		{
+			return false;
+		}
+		InstallPageTable(e, frame);
+	}
+	return true;
+}
+
+// Map 'count' pages starting at virtual address virt onto the physical blocks
+// starting at phys. 'flags' are added to each page table entry as well as
+// I86_PTE_PRESENT.
+//
+// Every page table the range needs is put in place before any page is mapped,
+// so the range is either mapped completely or not at all. Returns false if a
+// page table could not be allocated or part of the range is in a 4MB page.
+
+bool VMM_MapRange(uint32_t phys, virtual_address virt, uint32_t count, uint32_t flags)
+{
+	if (count == 0)
+	{
+		return true;
+	}
+	if (!AddPageTables(VMM_GetPageDirectoryEntryAddress(virt),
+					   VMM_GetPageDirectoryEntryAddress(virt + (count - 1) * PAGE_SIZE)))
+	{
+		return false;
+	}
+
+	// The page tables are next to each other in the self-mapped window, so
+	// the entries for the range are too
+	PageTableEntry* page = VMM_GetPageTableEntryAddress(virt);
+	uint32_t replaced = 0;
+	for (uint32_t i = 0; i < count; i++, page++, phys += PAGE_SIZE, virt += PAGE_SIZE)
+	{
+		uint32_t global = _globalPages && virt >= KERNEL_SPACE_START ? I86_PTE_CPU_GLOBAL : 0;
+		bool wasPresent = PTE_IsPresent(*page);
+		if (!wasPresent && global)
+		{
+			_globalPageCount++;
+		}
+		*page = 0;
+		PTE_AddAttribute(page, I86_PTE_PRESENT | flags | global);
+		PTE_SetFrame(page, phys);
+		if (wasPresent)
+		{
+			// The old translation may still be in the TLB
+			replaced++;
+			if (count <= TLB_FLUSH_THRESHOLD)
+			{
+				VMM_FlushTLBEntry(virt);
+			}
+		}
+	}
+	if (replaced > 0 && count > TLB_FLUSH_THRESHOLD)
+	{
+		HAL_FlushTLB();
+		_fullTLBFlushes++;
+	}
+	return true;
+}
+
+// Returns true if the block at physical address frame is managed by the
+// PMM, is allocated and can be shared between address spaces by counting
+// references to it. Anything else, such as memory-mapped hardware, is
+// shared as it is.
+
+bool IsSharedBlock(uint32_t frame)
+{
+	PageFrame* pageFrame = PMM_GetPageFrame((void*)frame);
+	if (!pageFrame || pageFrame->RefCount == 0)
+	{
+		return false;
+	}
+	return pageFrame->Owner != PMM_OWNER_NONE && pageFrame->Owner != PMM_OWNER_RESERVED;
+}
+
+// Unmap 'count' pages starting at virtual address virt and give the blocks
+// they were mapped to back to the physical memory manager. Blocks that are
+// shared with another mapping just lose a reference, and blocks that were
+// not allocated from the PMM are only unmapped. Pages that are not mapped,
+// or are in a 4MB page, are left alone.
+
+void VMM_UnmapRange(virtual_address virt, uint32_t count)
+{
+	bool flushAll = count > TLB_FLUSH_THRESHOLD;
+	bool unmapped = false;
+
+	// Blocks are freed in runs of consecutive blocks, so that a range that
+	// was mapped onto contiguous memory is freed with one call. Nothing uses
+	// the range while it is being unmapped, so the blocks can be freed before
+	// the TLB is flushed at the end.
+	uint32_t runStart = 0;
+	uint32_t runLength = 0;
+	for (uint32_t i = 0; i < count; i++, virt += PAGE_SIZE)
+	{
+		PageDirectoryEntry* e = VMM_GetPageDirectoryEntryAddress(virt);
+		SyncKernelPageTable(e);
+		if (!PDE_IsPresent(*e) || PDE_Is4MB(*e))
+		{
+			continue;
+		}
+		PageTableEntry* page = VMM_GetPageTableEntryAddress(virt);
+		if (!PTE_IsPresent(*page))
+		{
+			continue;
+		}
+		uint32_t frame = PTE_PhysicalAddress(*page);
+		if (*page & I86_PTE_CPU_GLOBAL)
+		{
+			_globalPageCount--;
+		}
+		*page = 0;
+		unmapped = true;
+		if (!flushAll)
+		{
+			VMM_FlushTLBEntry(virt);
+		}
+		if (!IsSharedBlock(frame))
+		{
+			// Memory that the PMM did not hand out, such as mapped hardware
+			// or reserved memory, is only unmapped
+			continue;
+		}
+		if (PMM_GetPageFrame((void*)frame)->RefCount > 1)
+		{
+			PMM_ReleaseBlock((void*)frame);
+			continue;
+		}
+		if (runLength > 0 && frame == runStart + runLength * PAGE_SIZE)
+		{
+			runLength++;
+			continue;
+		}
+		if (runLength > 0)
+		{
+			PMM_FreeBlocks((void*)runStart, runLength);
+		}
+		runStart = frame;
+		runLength = 1;
+	}
+	if (runLength > 0)
+	{
+		PMM_FreeBlocks((void*)runStart, runLength);
+	}
+	if (unmapped && flushAll)
+	{
+		HAL_FlushTLB();
+		_fullTLBFlushes++;
+	}
+}
+
 void VMM_MapPage(void* phys, void* virt) 
 {
-    // Get page directory
-    PageDirectory* pageDirectory = VMM_GetDirectory();
+	VMM_MapRange((uint32_t)phys, (virtual_address)virt, 1, I86_PTE_WRITABLE);
+}
+
+// Reserve 'size' bytes of virtual addresses from start. Pages in the range
+// are mapped by VMM_HandlePageFault the first time they are touched, with
+// 'flags' added to their page table entries, once they have been committed
+// with VMM_CommitDemandRegion.
+
+bool VMM_AddDemandRegion(virtual_address start, uint32_t size, uint32_t flags)
+{
+	if (_demandRegionCount == MAX_DEMAND_REGIONS || size == 0)
+	{
+		return false;
+	}
+	DemandRegion* region = &_demandRegions[_demandRegionCount++];
+	region->Start = start & ~(PAGE_SIZE - 1);
+	region->End = start + size;
+	region->CommittedEnd = region->Start;
+	region->Flags = flags;
+	return true;
+}
+
+// Commit memory for the next 'size' bytes of the demand region that starts
+// at 'start'.
+//
+// The blocks are promised by the PMM and the page tables for the pages are
+// put in place now, so that touching the pages later cannot fail for want of
+// memory. Returns false if there is not enough memory or the region is full.
+
+bool VMM_CommitDemandRegion(virtual_address start, uint32_t size)
+{
+	DemandRegion* region = 0;
+	for (uint32_t i = 0; i < _demandRegionCount; i++)
+	{
+		if (_demandRegions[i].Start == (start & ~(PAGE_SIZE - 1)))
+		{
+			region = &_demandRegions[i];
+			break;
+		}
+	}
+	uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (!region || pages == 0 || pages > (region->End - region->CommittedEnd) / PAGE_SIZE)
+	{
+		return false;
+	}
+	if (!PMM_CommitBlocks(pages))
+	{
+		return false;
+	}
+	virtual_address end = region->CommittedEnd + pages * PAGE_SIZE;
+	if (!AddPageTables(VMM_GetPageDirectoryEntryAddress(region->CommittedEnd),
+					   VMM_GetPageDirectoryEntryAddress(end - 1)))
+	{
+		PMM_UncommitBlocks(pages);
+		return false;
+	}
+	region->CommittedEnd = end;
+	return true;
+}
+
+// Add the time since startTime to the time spent handling page faults
+
+void RecordFaultTime(uint64_t startTime)
+{
+	uint32_t cycles = (uint32_t)(HAL_ReadTimeStampCounter() - startTime);
+	_faultCycles += cycles;
+	if (cycles > _maximumFaultCycles)
+	{
+		_maximumFaultCycles = cycles;
+	}
+}
+
+// Allocate a block that can be reached through the direct map
+
+uint32_t AllocateDirectMappedBlock()
+{
+	void* p = PMM_AllocateBlock();
+	if (p && !phys_to_virt((uint32_t)p))
+	{
+		// Above the direct map, so try below 16MB instead
+		PMM_FreeBlock(p);
+		p = PMM_AllocateBlocksInZone(PMM_ZONE_DMA, 1);
+	}
+	return (uint32_t)p;
+}
+
+// Handle a write to a copy-on-write page. If the block is still shared, the
+// page gets a copy of its own. Returns false if addr is not copy-on-write or
+// there is no memory for the copy.
+
+bool CopyOnWrite(virtual_address addr)
+{
+	PageDirectoryEntry* e = VMM_GetPageDirectoryEntryAddress(addr);
+	if (!PDE_IsPresent(*e) || PDE_Is4MB(*e))
+	{
+		return false;
+	}
+	PageTableEntry* page = VMM_GetPageTableEntryAddress(addr);
+	if (!(*page & VMM_PTE_COPY_ON_WRITE))
+	{
+		return false;
+	}
+	virtual_address pageAddress = addr & ~(PAGE_SIZE - 1);
+	uint32_t frame = PTE_PhysicalAddress(*page);
+	if (PMM_GetPageFrame((void*)frame)->RefCount > 1)
+	{
+		uint32_t copy = AllocateDirectMappedBlock();
+		if (!copy)
+		{
+			return false;
+		}
+		memcpy(phys_to_virt(copy), (void*)pageAddress, PAGE_SIZE);
+		PTE_SetFrame(page, copy);
+		PMM_ReleaseBlock((void*)frame);
+	}
+	// Either the page has its own copy now, or the other address spaces have
+	// all finished with the block, so it can be written to
+	PTE_RemoveAttribute(page, VMM_PTE_COPY_ON_WRITE);
+	PTE_AddAttribute(page, I86_PTE_WRITABLE);
+	VMM_FlushTLBEntry(pageAddress);
+	return true;
+}
+
+// Called by the page fault handler. If the address is in a demand paged
+// region and is not mapped yet, a block is mapped there and filled with
+// zeros. Returns false if the fault could not be handled.
+
+bool VMM_HandlePageFault(virtual_address addr, uint32_t errorCode)
+{
+	uint64_t startTime = HAL_ReadTimeStampCounter();
+	if (SyncKernelPageTable(VMM_GetPageDirectoryEntryAddress(addr)))
+	{
+		// The page table was added to the kernel after this address space
+		// was cloned
+		return true;
+	}
+	if (errorCode & PAGE_FAULT_PRESENT)
+	{
+		// The page is mapped, so this is a protection fault. The only ones
+		// expected are writes to pages shared by VMM_CloneAddressSpace.
+		if (!(errorCode & PAGE_FAULT_WRITE) || !CopyOnWrite(addr))
+		{
+			return false;
+		}
+		_copyOnWriteFaults++;
+		RecordFaultTime(startTime);
+		return true;
+	}
+	DemandRegion* region = 0;
+	for (uint32_t i = 0; i < _demandRegionCount; i++)
+	{
+		if (addr >= _demandRegions[i].Start && addr < _demandRegions[i].CommittedEnd)
+		{
+			region = &_demandRegions[i];
+			break;
+		}
+	}
+	if (!region)
+	{
+		return false;
+	}
+	// The block was committed and the page table put in place when the page
+	// was committed, so neither of these can fail
+	void* frame = PMM_AllocateCommittedBlock();
+	virtual_address page = addr & ~(PAGE_SIZE - 1);
+	if (!frame || !VMM_MapRange((uint32_t)frame, page, 1, region->Flags))
+	{
+		return false;
+	}
+	PMM_ZeroBlock((void*)page);
+
+	_minorFaults++;
+	RecordFaultTime(startTime);
+	return true;
+}
+
+void VMM_GetPageFaultStatistics(PageFaultStatistics * statistics)
+{
+	statistics->MinorFaults = _minorFaults;
+	statistics->CopyOnWriteFaults = _copyOnWriteFaults;
+	statistics->MaximumCycles = _maximumFaultCycles;
+
+	// Dividing a 64 bit number needs support code that the kernel is not
+	// linked with, so scale the total and count down until the total fits
+	// in 32 bits
+	uint64_t totalCycles = _faultCycles;
+	uint32_t faults = _minorFaults + _copyOnWriteFaults;
+	while (totalCycles > 0xFFFFFFFF)
+	{
+		totalCycles >>= 1;
+		faults >>= 1;
+	}
+	statistics->AverageCycles = faults ? (uint32_t)totalCycles / faults : 0;
+}
+
+// Create a new address space that is a copy of the current one. Kernel page
+// tables are shared. User pages are shared too, with writable ones made
+// read-only and copy-on-write in both address spaces, so only the page tables
+// are copied. Returns the physical address of the new page directory, or 0
+// if there is not enough memory.
+
+PageDirectory* VMM_CloneAddressSpace()
+{
+	uint32_t directoryFrame = (uint32_t)PMM_AllocateZeroedBlock();
+	if (!directoryFrame)
+	{
+		return 0;
+	}
+	PMM_SetBlockOwner((void*)directoryFrame, 1, PMM_OWNER_PAGETABLE);
+	PageDirectory* directory = (PageDirectory*)phys_to_virt(directoryFrame);
+	PageDirectory* current = (PageDirectory*)PAGE_DIRECTORY_VIRTUAL_BASE;
+	bool madeReadOnly = false;
+	for (uint32_t i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_SPACE_START); i++)
+	{
+		PageDirectoryEntry entry = current->entries[i];
+		if (i == 0 || !PDE_IsPresent(entry) || PDE_Is4MB(entry))
+		{
+			// The first 4MB is the identity mapping of low memory, whether
+			// it is a 4MB page or a page table, and is shared as it is
+			directory->entries[i] = entry;
+			continue;
+		}
+		uint32_t tableFrame = (uint32_t)PMM_AllocateZeroedBlock();
+		if (!tableFrame)
+		{
+			VMM_FreeAddressSpace((PageDirectory*)directoryFrame);
+			directoryFrame = 0;
+			break;
+		}
+		PMM_SetBlockOwner((void*)tableFrame, 1, PMM_OWNER_PAGETABLE);
+		PageTableEntry* table = (PageTableEntry*)phys_to_virt(tableFrame);
+		PageTableEntry* source = VMM_GetPageTableEntryAddress(i * PTABLE_ADDR_SPACE_SIZE);
+		for (uint32_t j = 0; j < PAGES_PER_TABLE; j++)
+		{
+			PageTableEntry page = source[j];
+			if (!PTE_IsPresent(page))
+			{
+				continue;
+			}
+			uint32_t frame = PTE_PhysicalAddress(page);
+			if (IsSharedBlock(frame))
+			{
+				if (page & I86_PTE_WRITABLE)
+				{
+					page = (page & ~I86_PTE_WRITABLE) | VMM_PTE_COPY_ON_WRITE;
+					source[j] = page;
+					madeReadOnly = true;
+				}
+				PMM_ReferenceBlock((void*)frame);
+			}
+			table[j] = page;
+		}
+		directory->entries[i] = entry;
+		PDE_SetFrame(&directory->entries[i], tableFrame);
+	}
+	if (directoryFrame)
+	{
+		// The kernel directory has every kernel table, even ones added since
+		// the current address space was created
+		PageDirectory* kernelDirectory = (PageDirectory*)phys_to_virt((uint32_t)_kernelDirectory);
+		for (uint32_t i = PAGE_DIRECTORY_INDEX(KERNEL_SPACE_START); i < SELF_MAP_DIRECTORY_INDEX; i++)
+		{
+			directory->entries[i] = kernelDirectory->entries[i];
+		}
+		PageDirectoryEntry* selfEntry = &directory->entries[SELF_MAP_DIRECTORY_INDEX];
+		PDE_AddAttribute(selfEntry, I86_PDE_PRESENT);
+		PDE_AddAttribute(selfEntry, I86_PDE_WRITABLE);
+		PDE_SetFrame(selfEntry, directoryFrame);
+	}
+	if (madeReadOnly)
+	{
+		// Writable translations for pages that are now read-only may still
+		// be in the TLB
+		HAL_FlushTLB();
+		_fullTLBFlushes++;
+	}
+	return (PageDirectory*)directoryFrame;
+}
 
-    // Get page table
-    PageDirectoryEntry* e = &pageDirectory->entries[PAGE_DIRECTORY_INDEX((uint32_t)virt)];
-    if ((*e & I86_PTE_PRESENT) != I86_PTE_PRESENT) 
-    {
-		// Page table not present, so allocate it
-		PageTable* table = (PageTable*)PMM_AllocateBlock();
+// Free an address space created by VMM_CloneAddressSpace, with its user page
+// tables, dropping its references to the blocks its pages are mapped to. The
+// current address space and the kernel's cannot be freed.
+
+void VMM_FreeAddressSpace(PageDirectory* dir)
+{
+	PageDirectory* directory = (PageDirectory*)phys_to_virt((uint32_t)dir);
+	if (!directory || dir == _current_PageDirectory || dir == _kernelDirectory)
+	{
+		return;
+	}
+	for (uint32_t i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_SPACE_START); i++)
+	{
+		PageDirectoryEntry entry = directory->entries[i];
+		if (i == 0 || !PDE_IsPresent(entry) || PDE_Is4MB(entry))
+		{
+			// The identity mapping of low memory is shared by every address space
+			continue;
+		}
+		uint32_t tableFrame = PDE_PhysicalAddress(entry);
+		PageTableEntry* table = (PageTableEntry*)phys_to_virt(tableFrame);
 		if (!table)
 		{
-			return;
+			// A table above the direct map cannot be walked, so the blocks
+			// it maps are left allocated
+			continue;
+		}
+		for (uint32_t j = 0; j < PAGES_PER_TABLE; j++)
+		{
+			if (PTE_IsPresent(table[j]) && IsSharedBlock(PTE_PhysicalAddress(table[j])))
+			{
+				PMM_ReleaseBlock((void*)PTE_PhysicalAddress(table[j]));
+			}
 		}
-		// Clear page table
-		memset(table, 0, sizeof(PageTable));
+		PMM_FreeBlock((void*)tableFrame);
+	}
+	PMM_FreeBlock(dir);
+}
 
-		// create a new entry in the directory
-		PageDirectoryEntry* entry = &pageDirectory->entries[PAGE_DIRECTORY_INDEX((uint32_t)virt)];
+void* phys_to_virt(uint32_t phys)
+{
+	if (phys >= _directMapSize)
+	{
+		return 0;
+	}
+	return (void*)(DIRECT_MAP_BASE + phys);
+}
 
-		// Map in the table (
-		PDE_AddAttribute(entry, I86_PDE_PRESENT);
-		PDE_AddAttribute(entry, I86_PDE_WRITABLE);
-		PDE_SetFrame(entry, (uint32_t)table);
+uint32_t virt_to_phys(void* virt)
+{
+	virtual_address addr = (virtual_address)virt;
+	if (addr >= DIRECT_MAP_BASE && addr - DIRECT_MAP_BASE < _directMapSize)
+	{
+		return addr - DIRECT_MAP_BASE;
+	}
+	// Anything else has to be looked up in the page tables
+	PageDirectoryEntry* e = VMM_GetPageDirectoryEntryAddress(addr);
+	if (!PDE_IsPresent(*e))
+	{
+		return 0xFFFFFFFF;
+	}
+	if (PDE_Is4MB(*e))
+	{
+		return (*e & ~(PTABLE_ADDR_SPACE_SIZE - 1)) + (addr & (PTABLE_ADDR_SPACE_SIZE - 1));
+	}
+	PageTableEntry* page = VMM_GetPageTableEntryAddress(addr);
+	if (!PTE_IsPresent(*page))
+	{
+		return 0xFFFFFFFF;
 	}
+	return PTE_PhysicalAddress(*page) + (addr & (PAGE_SIZE - 1));
+}
 
-	// Get page table
-	PageTable* table = (PageTable*)PAGE_GET_PHYSICAL_ADDRESS(e);
+uint32_t VMM_GetDirectMapSize()
+{
+	return _directMapSize;
+}
 
-	// Get page
-	PageTableEntry* page = &table->entries[PAGE_TABLE_INDEX((uint32_t)virt)];
+// Map physical memory from DIRECT_MAP_BASE, using 4MB pages if the processor
+// has them. Called once paging is on, so that the page tables needed without
+// 4MB pages do not have to come from low memory.
 
-    // Map it in 
-    PTE_SetFrame(page, (uint32_t) phys);
-    PTE_AddAttribute( page, I86_PTE_PRESENT);
+void CreateDirectMap(bool largePages)
+{
+	// Map up to the top of usable memory in whole 4MB pieces
+	uint32_t blocks = PMM_GetAddressableBlockCount();
+	if (blocks > DIRECT_MAP_SIZE / PAGE_SIZE)
+	{
+		blocks = DIRECT_MAP_SIZE / PAGE_SIZE;
+	}
+	blocks = (blocks + PAGES_PER_TABLE - 1) & ~(PAGES_PER_TABLE - 1);
+	if (largePages)
+	{
+		PageDirectoryEntry* e = VMM_GetPageDirectoryEntryAddress(DIRECT_MAP_BASE);
+		for (uint32_t i = 0; i < blocks / PAGES_PER_TABLE; i++, e++)
+		{
+			*e = 0;
+			PDE_AddAttribute(e, I86_PDE_PRESENT | I86_PDE_WRITABLE | I86_PDE_4MB);
+			if (_globalPages)
+			{
+				PDE_AddAttribute(e, I86_PDE_CPU_GLOBAL);
+				_globalPageCount++;
+			}
+			PDE_SetFrame(e, i * PTABLE_ADDR_SPACE_SIZE);
+		}
+	}
+	else if (!VMM_MapRange(0, DIRECT_MAP_BASE, blocks, I86_PTE_WRITABLE))
+	{
+		return;
+	}
+	_directMapSize = blocks * PAGE_SIZE;
+	PMM_SetDirectMap(DIRECT_MAP_BASE, _directMapSize);
+}
+
+uint32_t VMM_GetPageDirectorySwitchCount()
+{
+	return _pageDirectorySwitches;
+}
+
+uint32_t VMM_GetAvoidedTLBFlushCount()
+{
+	return _avoidedTLBFlushes;
+}
+
+uint32_t VMM_GetGlobalPageCount()
+{
+	return _globalPageCount;
+}
+
+uint32_t VMM_GetSinglePageFlushCount()
+{
+	return _singlePageFlushes;
+}
+
+uint32_t VMM_GetFullTLBFlushCount()
+{
+	return _fullTLBFlushes;
 }
 
 void VMM_Initialise() 
 {
-	// Allocate default page table
-	PageTable* table = (PageTable*)PMM_AllocateBlock();
-	if (!table)
-    {
-		return;
-    }	
+	// If the processor supports 4MB pages, the first 4MB is identity mapped with
+	// a single large page. The kernel still needs a page table, since it is
+	// loaded at 1MB and a large page must start on a 4MB boundary.
+	bool largePages = (HAL_GetCPUFeatures() & HAL_CPU_FEATURE_PSE) != 0;
+
+	// If the processor supports global pages, the kernel's pages are marked as
+	// global so that they stay in the TLB when CR3 is reloaded. The first 4MB
+	// is shared by every address space too.
+	_globalPages = (HAL_GetCPUFeatures() & HAL_CPU_FEATURE_PGE) != 0;
+	uint32_t globalAttribute = _globalPages ? I86_PTE_CPU_GLOBAL : 0;
+	_globalPageCount = 0;
+
+	// Allocate default page table. Paging is not on yet with our directory, so the
+	// first page tables and the directory are written through the identity mapping
+	// of the first 4MB and must come from low memory. Once the directory has been
+	// loaded, page tables are reached through the self-map and can be anywhere.
+	PageTable* table = 0;
+	if (!largePages)
+	{
+		table = (PageTable*)PMM_AllocateZeroedBlock();
+		if (!table)
+		{
+			return;
+		}
+		PMM_SetBlockOwner(table, 1, PMM_OWNER_PAGETABLE);
+		// The first 4MB of virtual addresses are mapped to the same physical addresses
+		for (int i = 0, frame=0x0, virt=0x00000000; i<1024; i++, frame += 4096, virt += 4096) 
+		{
+			// Create a new page
+			PageTableEntry page = 0;
+			PTE_AddAttribute(&page, I86_PTE_PRESENT | I86_PTE_WRITABLE | globalAttribute);
+			PTE_SetFrame(&page, frame);
+			// and add it to the page table
+			table->entries[PAGE_TABLE_INDEX(virt)] = page;
+		}
+		_globalPageCount += _globalPages ? 1024 : 0;
+	}
     // Allocate 3GB page table
-    PageTable* table2 = (PageTable*)PMM_AllocateBlock();
+    PageTable* table2 = (PageTable*)PMM_AllocateZeroedBlock();
     if (!table2)
 	{
 		return;
 	}
-	// Clear page table
-	memset(table, 0, sizeof (PageTable));
-    // The first 4MB of virtual addresses are mapped to the same physical addresses
-    for (int i = 0, frame=0x0, virt=0x00000000; i<1024; i++, frame += 4096, virt += 4096) 
-	{
-		// Create a new page
-		PageTableEntry page = 0;
-		PTE_AddAttribute(&page, I86_PTE_PRESENT);
-		PTE_SetFrame(&page, frame);
-		// and add it to the page table
-		table->entries[PAGE_TABLE_INDEX(virt)] = page;
-	}
+	PMM_SetBlockOwner(table2, 1, PMM_OWNER_PAGETABLE);
 
 	// Map 16mb to 3GB (where our kernel is)
-	memset(table2, 0, sizeof (PageTable));
 	for (int i=0, frame=0x100000, virt=0xc0000000; i<1024; i++, frame += 4096, virt += 4096) 
 	{
 		// Create a new page
 		PageTableEntry page = 0;
-		PTE_AddAttribute(&page, I86_PTE_PRESENT);
+		PTE_AddAttribute(&page, I86_PTE_PRESENT | I86_PTE_WRITABLE | globalAttribute);
 		PTE_SetFrame(&page, frame);
 		// and add it to the page table
 		table2->entries[PAGE_TABLE_INDEX(virt)] = page;
 	}
+	_globalPageCount += _globalPages ? 1024 : 0;
 
 	// Create default directory table
-	PageDirectory* dir = (PageDirectory*)PMM_AllocateBlocks(3);
+	PageDirectory* dir = (PageDirectory*)PMM_AllocateBlocksInZone(PMM_ZONE_LOW, 3);
 	if (!dir)
 	{
 			return;
 	}
+	PMM_SetBlockOwner(dir, 3, PMM_OWNER_PAGETABLE);
 	// clear directory table and set it as current
 	memset(dir, 0, sizeof(PageDirectory));
 
-	// Get first entry in directory table and set it up to point to our table
+	// Get first entry in directory table and set it up to point to our table,
+	// or to map the first 4MB directly
 	PageDirectoryEntry* entry = &dir->entries[PAGE_DIRECTORY_INDEX(0x00000000)];
 	PDE_AddAttribute(entry, I86_PDE_PRESENT);
 	PDE_AddAttribute(entry, I86_PDE_WRITABLE);
-	PDE_SetFrame(entry, (uint32_t)table);
+	if (largePages)
+	{
+		PDE_AddAttribute(entry, I86_PDE_4MB | (_globalPages ? I86_PDE_CPU_GLOBAL : 0));
+		PDE_SetFrame(entry, 0x00000000);
+		_globalPageCount += _globalPages ? 1 : 0;
+		// Large pages have to be turned on before the directory is loaded
+		HAL_EnableLargePages();
+	}
+	else
+	{
+		PDE_SetFrame(entry, (uint32_t)table);
+	}
 
 	// Set entry that points to the kernel
 	PageDirectoryEntry* entry2 = &dir->entries[PAGE_DIRECTORY_INDEX(0xc0000000)];
@@ -182,12 +919,30 @@ void VMM_Initialise()
     PDE_AddAttribute(entry2, I86_PDE_WRITABLE);
     PDE_SetFrame(entry2, (uint32_t)table2);
 
-    // Store current PDBR
-    _current_pdbr = (uint32_t)&dir->entries;
+	// Map the directory onto itself, so that it and the page tables can be
+	// edited without knowing where they are in physical memory. This entry
+	// differs between address spaces, so it is never global.
+	PageDirectoryEntry* selfEntry = &dir->entries[SELF_MAP_DIRECTORY_INDEX];
+	PDE_AddAttribute(selfEntry, I86_PDE_PRESENT);
+	PDE_AddAttribute(selfEntry, I86_PDE_WRITABLE);
+	PDE_SetFrame(selfEntry, (uint32_t)dir);
 
     // Switch to using our page directory
+	_kernelDirectory = dir;
     VMM_SwitchPageDirectory(dir);
 
 	// Enable paging
     HAL_EnablePaging();
+
+	// Global pages can only be turned on once paging is on
+	if (_globalPages)
+	{
+		HAL_EnableGlobalPages();
+	}
+
+	CreateDirectMap(largePages);
+
+	// Make the kernel obey read-only pages as well, so that its writes to
+	// copy-on-write pages fault too
+	HAL_EnableWriteProtection();
 }
@@ -19,6 +19,43 @@ typedef uint32_t virtual_address;
 #define PAGE_TABLE_INDEX(x) (((x) >> 12) & 0x3ff)
 #define PAGE_GET_PHYSICAL_ADDRESS(x) (*x & ~0xfff)
 
+// The last entry in every page directory points back at the directory. This
+// makes the page tables of the current address space appear as 4MB of memory
+// at PAGE_TABLES_VIRTUAL_BASE, with the directory itself as the last page.
+
+#define SELF_MAP_DIRECTORY_INDEX	1023
+#define PAGE_TABLES_VIRTUAL_BASE	0xFFC00000
+#define PAGE_DIRECTORY_VIRTUAL_BASE	0xFFFFF000
+
+// Physical memory is mapped in one piece from DIRECT_MAP_BASE, as far as
+// there is room for it below the page tables, so that any block can be
+// reached without mapping it first
+
+#define DIRECT_MAP_BASE				0xE0000000
+#define DIRECT_MAP_SIZE				(PAGE_TABLES_VIRTUAL_BASE - DIRECT_MAP_BASE)
+
+// Page table entry bit the processor leaves for the operating system to use.
+// Set on pages shared read-only by VMM_CloneAddressSpace that are copied the
+// first time they are written to.
+
+#define VMM_PTE_COPY_ON_WRITE	I86_PTE_LV4_GLOBAL
+
+// Bits in the error code for a page fault
+
+#define PAGE_FAULT_PRESENT	1		// Set if the page was present (a protection fault)
+#define PAGE_FAULT_WRITE	2		// Set if the access was a write
+#define PAGE_FAULT_USER		4		// Set if the access was from user mode
+
+// Statistics reported by VMM_GetPageFaultStatistics
+
+typedef struct _PageFaultStatistics
+{
+	uint32_t	MinorFaults;		// Faults handled by mapping a new page
+	uint32_t	CopyOnWriteFaults;	// Writes to shared pages that were handled
+	uint32_t	AverageCycles;		// Average processor cycles taken to handle a fault
+	uint32_t	MaximumCycles;		// Most processor cycles taken to handle a fault
+} PageFaultStatistics;
+
 // Page table
 typedef struct _PageTable 
 {
@@ -34,11 +71,62 @@ typedef struct _PageDirectory
 PageTableEntry* VMM_LookupPageTableEntry(PageTable * p,virtual_address addr); 
 PageDirectoryEntry* VMM_LookupPageDirectoryEntry(PageDirectory * p, virtual_address addr); 
 bool VMM_SwitchPageDirectory(PageDirectory* dir); 
+
+// Create a copy of the current address space that shares its pages until
+// they are written to, and free one again
+PageDirectory* VMM_CloneAddressSpace();
+void VMM_FreeAddressSpace(PageDirectory* dir);
 void VMM_FlushTLBEntry(virtual_address addr); 
 PageDirectory* VMM_GetDirectory(); 
+
+// Return where the entries that map an address in the current address space
+// can be read and written. The page table entry is only valid if the directory
+// entry is present and does not map a 4MB page.
+PageTableEntry* VMM_GetPageTableEntryAddress(virtual_address addr);
+PageDirectoryEntry* VMM_GetPageDirectoryEntryAddress(virtual_address addr);
 bool VMM_AllocatePage(PageTableEntry* e); 
 void VMM_FreePage(PageTableEntry* e); 
 void VMM_MapPage(void* phys, void* virt); 
+
+// Map 'count' pages from virt onto the physical blocks from phys, adding
+// 'flags' (I86_PTE_*) to each entry. Either maps the whole range or nothing.
+bool VMM_MapRange(uint32_t phys, virtual_address virt, uint32_t count, uint32_t flags);
+
+// Unmap 'count' pages from virt and free the blocks they were mapped to
+void VMM_UnmapRange(virtual_address virt, uint32_t count);
+
+// Reserve a range of addresses whose pages are only given memory when they
+// are first touched
+bool VMM_AddDemandRegion(virtual_address start, uint32_t size, uint32_t flags);
+
+// Commit memory for the next 'size' bytes of a demand region, so that they
+// can be touched. Returns false if there is not enough memory.
+bool VMM_CommitDemandRegion(virtual_address start, uint32_t size);
+
+// Try to resolve a page fault. Returns false if the fault is a real error.
+bool VMM_HandlePageFault(virtual_address addr, uint32_t errorCode);
+
+void VMM_GetPageFaultStatistics(PageFaultStatistics * statistics);
+
+// Get the address a physical address is mapped at in the direct map, or 0 if
+// it is past the end of the direct map
+void* phys_to_virt(uint32_t phys);
+
+// Get the physical address a virtual address is mapped to, or 0xFFFFFFFF if
+// it is not mapped
+uint32_t virt_to_phys(void* virt);
+
+// Get the number of bytes of physical memory in the direct map
+uint32_t VMM_GetDirectMapSize();
 void VMM_Initialise(); 
 
+// Statistics on page directory switches and global pages
+uint32_t VMM_GetPageDirectorySwitchCount();
+uint32_t VMM_GetAvoidedTLBFlushCount();
+uint32_t VMM_GetGlobalPageCount();
+
+// Statistics on TLB invalidation
+uint32_t VMM_GetSinglePageFlushCount();
+uint32_t VMM_GetFullTLBFlushCount();
+
 #endif
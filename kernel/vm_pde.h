@@ -17,7 +17,7 @@
 #define	I86_PDE_4MB					0x80		//0000000000000000000000010000000
 #define	I86_PDE_CPU_GLOBAL			0x100		//0000000000000000000000100000000
 #define	I86_PDE_LV4_GLOBAL			0x200		//0000000000000000000001000000000
-#define	I86_PDE_FRAME				0x7FFFF000 	//1111111111111111111000000000000
+#define	I86_PDE_FRAME				0xFFFFF000 	//11111111111111111111000000000000
 
 // A page directory entry
 typedef uint32_t PageDirectoryEntry;
@@ -18,7 +18,7 @@
 #define	I86_PTE_PAT					0x80		//0000000000000000000000010000000
 #define	I86_PTE_CPU_GLOBAL			0x100		//0000000000000000000000100000000
 #define	I86_PTE_LV4_GLOBAL			0x200		//0000000000000000000001000000000
-#define	I86_PTE_FRAME				0x7FFFF000 	//1111111111111111111000000000000
+#define	I86_PTE_FRAME				0xFFFFF000 	//11111111111111111111000000000000
 
 typedef uint32_t PageTableEntry;
 